@@ -0,0 +1,229 @@
+// plexdelta.cpp.
+//
+
+#include "stdafx.h"
+#include "plexmon.h"
+
+namespace {
+
+const uint32_t kChunksMagic = 0x6b637870;   // 'pxck'
+const uint32_t kChunksFormat = 1;
+
+const size_t kMinChunk = 2 * 1024;
+const size_t kAvgChunk = 8 * 1024;
+const size_t kMaxChunk = 64 * 1024;
+
+// Missing chunks next to each other are fetched with one read, up to this.
+const size_t kMaxFetch = 1024 * 1024;
+
+struct ChunksHeader {
+  uint32_t magic;
+  uint32_t format;
+  uint32_t count;
+  uint32_t min_size;
+  uint32_t avg_size;
+  uint32_t max_size;
+  long long total_size;
+};
+
+struct ChunkEntry {
+  long long offset;
+  uint32_t size;
+  uint32_t reserved;
+  plx::Sha256::Digest sha256;
+};
+
+struct DigestHash {
+  size_t operator()(const plx::Sha256::Digest& d) const {
+    size_t h;
+    memcpy(&h, &d[0], sizeof(h));
+    return h;
+  }
+};
+
+// The chunker looks at the whole binary, map it instead of copying it.
+bool MapWholeFile(const plx::FilePath& path, plx::MappedFile* mapped) {
+  auto op = plx::FileParams::ReadSequential_SharedRead();
+  auto file = plx::File::Create(path, op, plx::FileSecurity());
+  if (!file.is_valid())
+    return false;
+  *mapped = plx::MappedFile::Create(file);
+  return true;
+}
+
+std::vector<ChunkEntry> ChunkData(const plx::ContentChunker& chunker,
+                                  plx::Range<const uint8_t> data) {
+  std::vector<ChunkEntry> chunks;
+  long long offset = 0;
+  while (!data.empty()) {
+    auto len = chunker.next(data);
+    plx::Sha256 sha;
+    sha.update(data.slice(0, len));
+    ChunkEntry ce = { offset, plx::To<uint32_t>(len), 0, sha.finish() };
+    chunks.push_back(ce);
+    offset += len;
+    data.advance(len);
+  }
+  return chunks;
+}
+
+bool ReadChunks(const plx::FilePath& path, ChunksHeader* header,
+                std::vector<ChunkEntry>* chunks) {
+  auto op = plx::FileParams::Read_SharedRead();
+  auto file = plx::File::Create(path, op, plx::FileSecurity());
+  if (!file.is_valid())
+    return false;
+
+  auto hr = plx::RangeFromBytes(header, sizeof(*header));
+  if (file.read(hr, 0) != sizeof(*header))
+    return false;
+  if ((header->magic != kChunksMagic) || (header->format != kChunksFormat))
+    return false;
+  auto expected = sizeof(*header) + (size_t(header->count) * sizeof(ChunkEntry));
+  if (file.size_in_bytes() != plx::To<long long>(expected))
+    return false;
+
+  chunks->resize(header->count);
+  if (chunks->empty())
+    return true;
+  auto cr = plx::RangeFromVector(*chunks).bytes();
+  if (file.read(cr, sizeof(*header)) != cr.size())
+    return false;
+
+  // The chunks must tile the file exactly.
+  long long offset = 0;
+  for (auto& ce : *chunks) {
+    if ((ce.offset != offset) || !ce.size || (ce.size > header->max_size))
+      return false;
+    offset += ce.size;
+  }
+  return (offset == header->total_size);
+}
+
+bool ValidChunkerParams(const ChunksHeader& header) {
+  if (!header.avg_size || (header.avg_size & (header.avg_size - 1)))
+    return false;
+  return (header.min_size < header.avg_size) &&
+         (header.avg_size < header.max_size) &&
+         (header.max_size <= kMaxFetch);
+}
+
+}
+
+bool WriteChunkManifest(const plx::FilePath& file, const plx::FilePath& chunks_path) {
+  plx::MappedFile mapped;
+  if (!MapWholeFile(file, &mapped))
+    return false;
+  auto data = mapped.view();
+
+  plx::ContentChunker chunker(kMinChunk, kAvgChunk, kMaxChunk);
+  std::vector<ChunkEntry> chunks;
+  if (!data.empty())
+    chunks = ChunkData(chunker, data);
+
+  ChunksHeader header = {
+    kChunksMagic, kChunksFormat, plx::To<uint32_t>(chunks.size()),
+    uint32_t(kMinChunk), uint32_t(kAvgChunk), uint32_t(kMaxChunk),
+    plx::To<long long>(data.size())
+  };
+
+  auto op = plx::FileParams::Write_Exclusive(CREATE_ALWAYS);
+  auto out = plx::File::Create(chunks_path, op, plx::FileSecurity());
+  if (!out.is_valid())
+    return false;
+  plx::Range<const uint8_t> parts[2] = {
+    plx::RangeFromBytes(&header, sizeof(header))
+  };
+  if (!chunks.empty())
+    parts[1] = plx::RangeFromVector(chunks).const_bytes();
+  auto size = parts[0].size() + parts[1].size();
+  if (out.writev(plx::RangeFromArray(parts)) != size)
+    return false;
+  return out.flush();
+}
+
+bool BuildFromDelta(const plx::FilePath& local, const plx::FilePath& remote,
+                    const plx::FilePath& to, long long expected_size,
+                    const plx::Sha256::Digest& expected, DeltaStats* stats) {
+  ChunksHeader header;
+  std::vector<ChunkEntry> chunks;
+  plx::FilePath chunks_path(std::wstring(remote.raw()).append(L".chunks"));
+  if (!ReadChunks(chunks_path, &header, &chunks))
+    return false;
+  if (!ValidChunkerParams(header) || (header.total_size != expected_size))
+    return false;
+
+  // Cut the installed binary the same way the publisher did and index
+  // its chunks by digest.
+  plx::MappedFile mapped;
+  if (!MapWholeFile(local, &mapped))
+    return false;
+  auto base = mapped.view();
+  std::unordered_map<plx::Sha256::Digest, size_t, DigestHash> have;
+  if (!base.empty()) {
+    plx::ContentChunker chunker(header.min_size, header.avg_size, header.max_size);
+    for (auto& ce : ChunkData(chunker, base))
+      have.emplace(ce.sha256, plx::To<size_t>(ce.offset));
+  }
+
+  auto src = plx::File::Create(
+      remote, plx::FileParams::Read_SharedRead(), plx::FileSecurity());
+  if (!src.is_valid())
+    return false;
+
+  plx::FilePath tmp(std::wstring(to.raw()).append(L".tmp"));
+  bool ok = false;
+  {
+    auto dst = plx::File::Create(
+        tmp, plx::FileParams::Write_Exclusive(CREATE_ALWAYS), plx::FileSecurity());
+    if (!dst.is_valid())
+      return false;
+
+    plx::Sha256 sha;
+    std::vector<uint8_t> fetch(kMaxFetch);
+    stats->reused = 0;
+    stats->fetched = 0;
+
+    ok = true;
+    for (size_t ix = 0; ok && (ix != chunks.size());) {
+      plx::Range<const uint8_t> data;
+      auto it = have.find(chunks[ix].sha256);
+      if (it != end(have)) {
+        data = base.slice(it->second, chunks[ix].size);
+        stats->reused += chunks[ix].size;
+        ++ix;
+      } else {
+        // Coalesce the run of missing chunks into a single read.
+        size_t run = 0;
+        auto first = ix;
+        while ((ix != chunks.size()) &&
+               ((run + chunks[ix].size) <= kMaxFetch) &&
+               ((ix == first) || (have.find(chunks[ix].sha256) == end(have)))) {
+          run += chunks[ix].size;
+          ++ix;
+        }
+        if (src.read(&fetch[0], run, chunks[first].offset) != run) {
+          ok = false;
+          break;
+        }
+        data = plx::Range<const uint8_t>(&fetch[0], run);
+        stats->fetched += run;
+      }
+      sha.update(data);
+      ok = (dst.write(data) == data.size());
+    }
+
+    // The per-chunk digests only locate data, the whole file digest is what
+    // the manifest vouches for.
+    ok = ok && (sha.finish() == expected) && dst.flush();
+  }
+
+  if (ok) {
+    ok = ::MoveFileExW(tmp.raw(), to.raw(),
+                       MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ?
+        true : false;
+  }
+  if (!ok)
+    ::DeleteFileW(tmp.raw());
+  return ok;
+}
@@ -3,10 +3,8 @@
 
 #include "stdafx.h"
 
-#include <time.h>
 #include "plexmon.h"
-
-#define spf plx::StringPrintf
+#include "plexlogfmt.h"
 
 const char* ToString(SoftFailure f) {
   using sf = SoftFailure;
@@ -33,39 +31,812 @@ const char* ToString(HardFailure f) {
   return "[?]";
 }
 
+namespace {
+
+// The records are laid out as described in plexlogfmt.h.
+// Every logging session starts with a |session| record that holds what is
+// needed to render the rest: the clock and the name and format of each
+// event. The formats only use %d and %s style specifiers, the decoder
+// takes the type from the tag.
+
+enum class LogEvent : uint16_t {
+  session,
+  init,
+  close,
+  soft_fail,
+  hard_fail,
+  installing,
+  newer_found,
+  rolled_back,
+  delta_built,
+  dropped,
+  handshake,
+  process_new,
+  process_exit,
+  last
+};
+
+struct EventInfo {
+  LogEvent event;
+  const char* name;
+  const char* format;
+};
+
+const EventInfo kEvents[] = {
+  { LogEvent::init,         "init",        "log start pid %d" },
+  { LogEvent::close,        "close",       "endlog pid %d" },
+  { LogEvent::soft_fail,    "soft_fail",   "soft_fail line %d issue %s" },
+  { LogEvent::hard_fail,    "hard_fail",   "hard_fail line %d issue %s" },
+  { LogEvent::installing,   "installing",  "installing ver %s" },
+  { LogEvent::newer_found,  "newer_found", "newer_found ver %s" },
+  { LogEvent::rolled_back,  "rolled_back", "rolled_back ver %s" },
+  { LogEvent::delta_built,  "delta_built", "delta_built reused %d fetched %d" },
+  { LogEvent::dropped,      "dropped",     "dropped %d records" },
+  { LogEvent::handshake,    "handshake",   "handshake %s in %d ns" },
+  { LogEvent::process_new,  "process_new", "process_new pid %d" },
+  { LogEvent::process_exit, "process_exit", "process_exit pid %d code %d %s" },
+};
+
+// Serializes a record into a fixed buffer. Arguments that don't fit are
+// cut off, the size stays consistent.
+class RecordBuilder {
+  uint8_t* buf_;
+  size_t size_;
+  size_t used_;
+
+  void put(uint8_t tag, const void* data, size_t len) {
+    if (used_ + 1 + len > size_)
+      return;
+    buf_[used_] = tag;
+    memcpy(buf_ + used_ + 1, data, len);
+    used_ += 1 + len;
+  }
+
+public:
+  RecordBuilder(uint8_t* buf, size_t size, LogEvent event, uint64_t ticks)
+      : buf_(buf), size_(size), used_(sizeof(RecordHeader)) {
+    RecordHeader rh = {
+      0, uint16_t(event), ::GetCurrentThreadId(), ticks
+    };
+    memcpy(buf_, &rh, sizeof(rh));
+  }
+
+  void arg(int v) { put('i', &v, sizeof(v)); }
+  void arg(unsigned long v) { uint32_t u = v; put('u', &u, sizeof(u)); }
+  void arg(long long v) { put('I', &v, sizeof(v)); }
+
+  void arg(const char* str) {
+    uint8_t tmp[256];
+    auto len = std::min(strlen(str), size_t(255));
+    tmp[0] = uint8_t(len);
+    memcpy(&tmp[1], str, len);
+    put('s', tmp, len + 1);
+  }
+
+  void arg(const plx::Version& ver) {
+    uint16_t v[4] = {
+      uint16_t(ver.major()), uint16_t(ver.minor()),
+      uint16_t(ver.rev()), uint16_t(ver.build())
+    };
+    put('v', v, sizeof(v));
+  }
+
+  // Writes the final size in the header, returns it.
+  size_t finish() {
+    auto size = uint16_t(used_);
+    memcpy(buf_, &size, sizeof(size));
+    return used_;
+  }
+};
+
+// Expands a parameter pack into RecordBuilder::arg() calls, in order.
+inline void AddArgs(RecordBuilder&) {
+}
+
+template <typename T, typename... Args>
+void AddArgs(RecordBuilder& rb, const T& first, const Args&... rest) {
+  rb.arg(first);
+  AddArgs(rb, rest...);
+}
+
+uint64_t Ticks() {
+  return plx::Clock::Get().ticks();
+}
+
+// The session record, see the comment at the top. The wall clock of
+// |anchor| places the ticks of every record that follows. Returns its size.
+size_t BuildSession(uint8_t* buf, size_t size, const plx::Clock::Anchor& anchor) {
+  auto& clock = plx::Clock::Get();
+  RecordBuilder rb(buf, size, LogEvent::session, anchor.ticks);
+  AddArgs(rb, kLogMagic, static_cast<long long>(clock.frequency()), anchor.wall);
+  for (auto& ei : kEvents)
+    AddArgs(rb, int(ei.event), ei.name, ei.format);
+  return rb.finish();
+}
+
+// A log is rotated when it reaches either limit, rotated segments are
+// compressed and the oldest are deleted past |kRetainBytes|.
+const long long kRotateBytes = 4 * 1024 * 1024;
+const unsigned long long kRotateAgeMs = 24 * 60 * 60 * 1000ULL;
+// How long a log that could not be renamed keeps growing before the next try.
+const unsigned long long kRotateRetryMs = 10 * 60 * 1000ULL;
+const long long kRetainBytes = 32 * 1024 * 1024;
+
+const size_t kArchiveBlock = 256 * 1024;
+
+const wchar_t kSegmentExt[] = L".pxl";
+const wchar_t kArchiveExt[] = L".pxz";
+const wchar_t kIndexExt[] = L".pxi";
+const wchar_t kRecorderExt[] = L".pxr";
+const wchar_t kPrevRecorderExt[] = L".prev.pxr";
+
+// Rotated segments are named <base>.<utc yyyymmddhhmmssmmm><ext> so the
+// names sort by age.
+std::wstring SegmentName(const std::wstring& base, const wchar_t* ext) {
+  SYSTEMTIME st;
+  ::GetSystemTime(&st);
+  return plx::StringPrintf(L"%s.%04d%02d%02d%02d%02d%02d%03d%s",
+      base.c_str(), st.wYear, st.wMonth, st.wDay,
+      st.wHour, st.wMinute, st.wSecond, st.wMilliseconds, ext);
+}
+
+std::wstring ChangeExt(const std::wstring& name, const wchar_t* ext) {
+  return name.substr(0, name.find_last_of(L'.')) + ext;
+}
+
+bool IsSegment(const std::wstring& name, const std::wstring& base, const wchar_t* ext) {
+  const size_t kStampLen = 17;
+  auto ext_len = wcslen(ext);
+  if (name.size() != base.size() + 1 + kStampLen + ext_len)
+    return false;
+  if (name.compare(0, base.size(), base) || (name[base.size()] != L'.'))
+    return false;
+  for (size_t ix = 0; ix != kStampLen; ++ix) {
+    auto c = name[base.size() + 1 + ix];
+    if ((c < L'0') || (c > L'9'))
+      return false;
+  }
+  return name.compare(name.size() - ext_len, ext_len, ext) == 0;
+}
+
+// Compresses rotated segments and enforces the retention budget on its own
+// thread, so the flusher only pays for a rename.
+class LogArchiver {
+  struct Segment {
+    std::wstring name;
+    long long size;
+  };
+
+  plx::FilePath dir_;
+  std::wstring base_;
+  std::atomic<bool> stop_;
+  HANDLE wake_;
+  std::thread thread_;
+
+public:
+  LogArchiver(const plx::FilePath& dir, const std::wstring& base)
+      : dir_(dir), base_(base), stop_(false),
+        wake_(::CreateEventW(nullptr, FALSE, TRUE, nullptr)) {
+    if (!wake_)
+      throw plx::Kernel32Exception(__LINE__, plx::Kernel32Exception::waitable);
+    // The event starts signaled to pick up what a previous run left.
+    thread_ = std::thread(&LogArchiver::run, this);
+  }
+
+  ~LogArchiver() {
+    stop_ = true;
+    ::SetEvent(wake_);
+    thread_.join();
+    ::CloseHandle(wake_);
+  }
+
+  void kick() {
+    ::SetEvent(wake_);
+  }
+
+private:
+  void run() {
+    while (true) {
+      ::WaitForSingleObject(wake_, INFINITE);
+      if (stop_)
+        return;
+      try {
+        if (plx::BlockCodec::available()) {
+          for (auto& seg : list(kSegmentExt))
+            archive(seg.name);
+        }
+        prune();
+      } catch (plx::Exception&) {
+        // Try again on the next rotation.
+      }
+    }
+  }
+
+  std::vector<Segment> list(const wchar_t* ext) {
+    std::vector<Segment> segments;
+    auto par = plx::FileParams::Directory_ShareAll();
+    auto dir = plx::File::Create(dir_, par, plx::FileSecurity());
+    if (!dir.is_valid())
+      return segments;
+    auto finf = plx::FilesInfo::Stream(
+        dir, plx::FilesInfo::files_only, base_ + L".");
+    for (finf.first(); !finf.done(); finf.next()) {
+      auto name = plx::WideStringFromRange(finf.file_name());
+      if (!IsSegment(name, base_, ext))
+        continue;
+      Segment seg = { name, finf.size_in_bytes() };
+      segments.push_back(seg);
+    }
+    return segments;
+  }
+
+  void archive(const std::wstring& name) {
+    auto from = dir_.append(name);
+    auto to_name = name.substr(0, name.size() - wcslen(kSegmentExt)) + kArchiveExt;
+    auto to = dir_.append(to_name);
+    plx::FilePath tmp(std::wstring(to.raw()).append(L".tmp"));
+
+    bool ok = false;
+    {
+      auto src = plx::File::Create(
+          from, plx::FileParams::ReadSequential_SharedRead(), plx::FileSecurity());
+      if (!src.is_valid())
+        return;
+      auto mapped = plx::MappedFile::Create(src);
+      auto data = mapped.view();
+
+      plx::BlockCodec codec;
+      std::vector<uint8_t> out;
+      uint32_t header[2] = { kArchiveMagic, kArchiveFormat };
+      out.insert(end(out), reinterpret_cast<uint8_t*>(header),
+                 reinterpret_cast<uint8_t*>(header) + sizeof(header));
+      while (!data.empty()) {
+        auto block = data.slice(0, std::min(data.size(), kArchiveBlock));
+        auto at = out.size();
+        out.resize(at + 8);
+        uint32_t sizes[2] = { plx::To<uint32_t>(block.size()), 0 };
+        sizes[1] = plx::To<uint32_t>(codec.compress(block, &out));
+        memcpy(&out[at], sizes, sizeof(sizes));
+        data.advance(block.size());
+      }
+
+      auto dst = plx::File::Create(
+          tmp, plx::FileParams::Write_Exclusive(CREATE_ALWAYS), plx::FileSecurity());
+      if (!dst.is_valid())
+        return;
+      ok = (dst.write(plx::RangeFromVector(out).const_bytes()) == out.size()) &&
+           dst.flush();
+    }
+
+    if (ok) {
+      ok = ::MoveFileExW(tmp.raw(), to.raw(),
+                         MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ?
+          true : false;
+    }
+    if (ok) {
+      // The offsets of the time index are of no use in the archive.
+      ::DeleteFileW(from.raw());
+      ::DeleteFileW(dir_.append(ChangeExt(name, kIndexExt)).raw());
+    } else {
+      ::DeleteFileW(tmp.raw());
+    }
+  }
+
+  // Keeps the newest segments, compressed or not, within the budget.
+  void prune() {
+    auto segments = list(kArchiveExt);
+    auto raw = list(kSegmentExt);
+    segments.insert(end(segments), begin(raw), end(raw));
+    std::sort(begin(segments), end(segments),
+        [](const Segment& l, const Segment& r) { return l.name > r.name; });
+    long long total = 0;
+    for (auto& seg : segments) {
+      total += seg.size;
+      if (total > kRetainBytes) {
+        ::DeleteFileW(dir_.append(seg.name).raw());
+        ::DeleteFileW(dir_.append(ChangeExt(seg.name, kIndexExt)).raw());
+      }
+    }
+  }
+};
+
+}
+
+// The time index has one entry for every |kIndexBlock| records of the log,
+// so a query reads only the blocks that can match.
+const uint32_t kIndexBlock = 256;
+
+// Used by the flusher only, it sees every record with its offset.
+class TimeIndex {
+  plx::File file_;
+  TimeIndexEntry block_;
+  uint64_t min_ticks_;
+  uint64_t max_ticks_;
+  long long session_offset_;
+  plx::Clock::Anchor anchor_;
+
+public:
+  TimeIndex() : min_ticks_(0), max_ticks_(0), session_offset_(0) {
+    block_.count = 0;
+    anchor_.ticks = 0;
+    anchor_.wall = 0;
+  }
+
+  // |base| is the size of the log, where the index starts if it is new.
+  void open(const plx::FilePath& path, long long base) {
+    file_ = plx::File::Create(
+        path, plx::FileParams::Append_SharedRead(), plx::FileSecurity());
+    block_.count = 0;
+    if (!file_.is_valid() || file_.size_in_bytes())
+      return;
+    TimeIndexHeader header = { kIndexMagic, kIndexFormat, base };
+    file_.write(&header, sizeof(header), -1);
+  }
+
+  void close() {
+    end_block();
+    file_ = plx::File();
+  }
+
+  void session(long long offset, const plx::Clock::Anchor& anchor) {
+    end_block();
+    session_offset_ = offset;
+    anchor_ = anchor;
+  }
+
+  void add(long long offset, const uint8_t* record) {
+    RecordHeader rh;
+    memcpy(&rh, record, sizeof(rh));
+    if (!block_.count) {
+      block_.offset = offset;
+      block_.session_offset = session_offset_;
+      block_.events = 0;
+      block_.size = 0;
+      min_ticks_ = rh.ticks;
+      max_ticks_ = rh.ticks;
+    }
+    min_ticks_ = std::min(min_ticks_, rh.ticks);
+    max_ticks_ = std::max(max_ticks_, rh.ticks);
+    block_.events |= 1ULL << (rh.event & 63);
+    block_.size += rh.size;
+    if (++block_.count == kIndexBlock)
+      end_block();
+  }
+
+private:
+  void end_block() {
+    if (block_.count && file_.is_valid()) {
+      block_.first_wall = wall(min_ticks_);
+      block_.last_wall = wall(max_ticks_);
+      file_.write(&block_, sizeof(block_), -1);
+    }
+    block_.count = 0;
+  }
+
+  // Records can be stamped a bit before the session that they follow.
+  long long wall(uint64_t ticks) const {
+    auto& clock = plx::Clock::Get();
+    auto delta = static_cast<long long>(ticks - anchor_.ticks);
+    auto ns = (delta < 0) ? -clock.to_ns(0 - uint64_t(delta)) : clock.to_ns(delta);
+    return anchor_.wall + (ns / 100);
+  }
+};
+
+// A record, built in place in the ring of the thread that logs.
+struct LogLine {
+  unsigned long long seq;
+  unsigned int size;
+  uint8_t data[244];
+};
+
+typedef plx::SpscRing<LogLine, 512> LogRing;
+
+// The recorder file is a header page with the session record followed by
+// |kRecorderSlots| slots. A record goes to the slot picked by its sequence
+// number, so the file always holds the latest records.
+const uint32_t kRecorderSlots = 16 * 1024;
+const uint32_t kRecorderData = 16 * 1024;
+
+// |seq| is zero while the slot is being written, a crash in the middle
+// leaves it that way and the reader skips the slot.
+struct RecorderSlot {
+  std::atomic<unsigned long long> seq;
+  uint8_t data[248];
+};
+
+static_assert(sizeof(LogLine::data) <= sizeof(RecorderSlot::data),
+              "records must fit in a recorder slot");
+
+// Keeps the last records of this run in a shared file mapping. The pages
+// belong to the system cache, so what was copied there reaches the disk
+// even if the process dies right after. Recording is a copy, it never
+// locks or calls the system. The file of the previous run is kept next
+// to it, to look at after a crash and a restart.
+class FlightRecorder {
+  plx::File file_;
+  plx::MappedFile mapped_;
+  RecorderSlot* slots_;
+
+  FlightRecorder(plx::File&& file, plx::MappedFile&& mapped)
+      : file_(std::move(file)), mapped_(std::move(mapped)) {
+    auto view = mapped_.writable_view();
+    slots_ = reinterpret_cast<RecorderSlot*>(view.start() + kRecorderData);
+  }
+
+public:
+  static std::unique_ptr<FlightRecorder> Create(const plx::FilePath& path,
+                                                const plx::FilePath& prev_path) {
+    ::MoveFileExW(path.raw(), prev_path.raw(), MOVEFILE_REPLACE_EXISTING);
+    auto file = plx::File::Create(
+        path, plx::FileParams::ReadWrite_SharedRead(CREATE_ALWAYS),
+        plx::FileSecurity());
+    if (!file.is_valid())
+      return nullptr;
+    auto size = kRecorderData + (kRecorderSlots * sizeof(RecorderSlot));
+    auto mapped = plx::MappedFile::CreateWritable(file, plx::To<long long>(size));
+    auto view = mapped.writable_view();
+
+    RecorderHeader header = {
+      kRecorderMagic, kRecorderFormat, sizeof(RecorderSlot), kRecorderSlots,
+      kRecorderData, 0
+    };
+    auto session = view.start() + sizeof(header);
+    header.session_size = plx::To<uint32_t>(BuildSession(
+        session, kRecorderData - sizeof(header), plx::Clock::Get().anchor()));
+    memcpy(view.start(), &header, sizeof(header));
+    return std::unique_ptr<FlightRecorder>(
+        new FlightRecorder(std::move(file), std::move(mapped)));
+  }
+
+  void record(unsigned long long seq, const uint8_t* data, size_t size) {
+    auto& slot = slots_[seq & (kRecorderSlots - 1)];
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(slot.data, data, size);
+    slot.seq.store(seq + 1, std::memory_order_release);
+  }
+};
+
+// Log calls serialize straight into a per-thread ring and return, the
+// flusher thread collects the records of all rings in order and writes them
+// in batches. When a ring is full the record is dropped and counted, logging
+// never waits for the disk. How often the file is synced is up to the
+// LogSync policy, which the flusher applies once per group of records.
 class Logger {
+  plx::FilePath path_;
   plx::File file_;
-  unsigned long long tick_;
+  long long bytes_;
+  unsigned long long opened_ms_;
+  bool has_records_;
+  std::unique_ptr<LogArchiver> archiver_;
+  std::atomic<unsigned long long> seq_;
+  std::atomic<long> dropped_;
+  std::mutex rings_lock_;
+  std::vector<std::unique_ptr<LogRing>> rings_;
+  std::atomic<bool> stop_;
+  HANDLE wake_;
+  std::thread flusher_;
+  std::unique_ptr<FlightRecorder> recorder_;
+  TimeIndex index_;
+  std::atomic<int> sync_mode_;
+  std::atomic<unsigned int> sync_ms_;
+  std::atomic<unsigned int> sync_records_;
+  std::atomic<size_t> wake_at_;
+  std::atomic<bool> urgent_;
+  // Only the flusher uses these three.
+  size_t unsynced_;
+  unsigned long long synced_ms_;
+  unsigned long long retry_ms_;
+
+  // Each logger gets a new generation, so a ring left in a thread by a
+  // logger that is gone is never taken for one of the current logger, even
+  // when the new logger has the same address.
+  const unsigned long long generation_;
+  static std::atomic<unsigned long long> generations;
+  static __declspec(thread) LogRing* th_ring;
+  static __declspec(thread) unsigned long long th_generation;
 
 public:
   Logger(const plx::FilePath path)
-    : file_(plx::File::Create(
+    : path_(path),
+      file_(plx::File::Create(
           path, plx::FileParams::Append_SharedRead(),
           plx::FileSecurity())),
-      tick_(::GetTickCount64()) {
+      bytes_(0),
+      opened_ms_(::GetTickCount64()),
+      has_records_(false),
+      seq_(0),
+      dropped_(0),
+      stop_(false),
+      wake_(::CreateEventW(nullptr, FALSE, FALSE, nullptr)),
+      sync_mode_(int(LogSyncMode::none)),
+      sync_ms_(0),
+      sync_records_(0),
+      wake_at_(kWakeAt),
+      urgent_(false),
+      unsynced_(0),
+      synced_ms_(::GetTickCount64()),
+      retry_ms_(0),
+      generation_(++generations) {
     if (!file_.is_valid())
       throw plx::IOException(__LINE__, path.raw());
+    if (!wake_)
+      throw plx::Kernel32Exception(__LINE__, plx::Kernel32Exception::waitable);
+    archiver_.reset(new LogArchiver(path.parent(), base_name()));
+    try {
+      auto dir = path.parent();
+      recorder_ = FlightRecorder::Create(dir.append(base_name() + kRecorderExt),
+                                         dir.append(base_name() + kPrevRecorderExt));
+    } catch (plx::Exception&) {
+      // Logging works without it.
+    }
+    bytes_ = file_.size_in_bytes();
+    index_.open(index_path(), bytes_);
+    bytes_ += write_session();
+    flusher_ = std::thread(&Logger::flush_loop, this);
+  }
+
+  ~Logger() {
+    stop_ = true;
+    ::SetEvent(wake_);
+    flusher_.join();
+    ::CloseHandle(wake_);
+    archiver_.reset();
+  }
+
+  template <typename... Args>
+  void emit(LogEvent event, const Args&... args) {
+    auto ring = thread_ring();
+    // The recorder gets the record even when the ring is full.
+    LogLine spare;
+    auto line = ring->reserve();
+    auto target = line ? line : &spare;
+    RecordBuilder rb(target->data, sizeof(target->data), event, Ticks());
+    AddArgs(rb, args...);
+    target->size = plx::To<unsigned int>(rb.finish());
+    target->seq = seq_++;
+    if (recorder_)
+      recorder_->record(target->seq, target->data, target->size);
+    if (!line) {
+      ++dropped_;
+      return;
+    }
+    ring->commit();
+    if (ring->size() >= wake_at_.load(std::memory_order_relaxed))
+      ::SetEvent(wake_);
+  }
+
+  void set_sync(const LogSync& sync) {
+    sync_ms_ = sync.interval_ms;
+    sync_records_ = sync.records;
+    sync_mode_ = int(sync.mode);
+    // Waking the flusher sooner keeps the groups within the record count.
+    auto wake_at = kWakeAt;
+    if ((sync.mode == LogSyncMode::every_n) && sync.records)
+      wake_at = std::min<size_t>(wake_at, sync.records);
+    wake_at_ = wake_at;
+  }
+
+  // Gets the records logged so far to disk soon, whatever the policy. The
+  // caller does not wait for it.
+  void sync_soon() {
+    urgent_ = true;
+    ::SetEvent(wake_);
+  }
+
+private:
+  LogRing* thread_ring() {
+    if (th_generation != generation_) {
+      std::lock_guard<std::mutex> guard(rings_lock_);
+      rings_.emplace_back(new LogRing);
+      th_ring = rings_.back().get();
+      th_generation = generation_;
+    }
+    return th_ring;
+  }
+
+  // Written directly, before records from the rings can go after it.
+  size_t write_session() {
+    std::vector<uint8_t> buf(64 * 1024);
+    auto anchor = plx::Clock::Get().anchor();
+    index_.session(bytes_, anchor);
+    return file_.write(&buf[0], BuildSession(&buf[0], buf.size(), anchor), -1);
   }
 
-  void add(const std::string& line) {
-    file_.write(plx::RangeFromString(line));
+  bool needs_sync(bool stopping, bool urgent) const {
+    if (!unsynced_ || !file_.is_valid())
+      return false;
+    if (urgent)
+      return true;
+    switch (LogSyncMode(sync_mode_.load())) {
+      case LogSyncMode::interval:
+        return stopping || (::GetTickCount64() - synced_ms_ >= sync_ms_);
+      case LogSyncMode::every_n:
+        return stopping || (unsynced_ >= sync_records_);
+      default:
+        return false;
+    }
   }
 
-  void add_now_readable() {
-    time_t ltime;
-    time(&ltime);
-    char buf[26];
-    ctime_s(buf, sizeof(buf), &ltime);
-    add(buf);
+  void sync() {
+    file_.flush();
+    unsynced_ = 0;
+    synced_ms_ = ::GetTickCount64();
   }
 
-  unsigned long ts() const {
-    auto d = ::GetTickCount64() - tick_;
-    return static_cast<unsigned long>(d / 100);
+  bool needs_rotation() const {
+    if (::GetTickCount64() < retry_ms_)
+      return false;
+    if (bytes_ >= kRotateBytes)
+      return true;
+    return has_records_ && (::GetTickCount64() - opened_ms_ >= kRotateAgeMs);
+  }
+
+  // Only the flusher touches the file, so the loggers never notice the
+  // switch. If the rename fails, likely because someone has the log open
+  // without FILE_SHARE_DELETE, the same file is reopened and keeps growing
+  // until the next try.
+  void rotate() {
+    if (unsynced_ && (LogSyncMode(sync_mode_.load()) != LogSyncMode::none))
+      sync();
+    unsynced_ = 0;
+    auto segment = SegmentName(base_name(), kSegmentExt);
+    auto rotated = path_.parent().append(segment);
+    file_ = plx::File();
+    index_.close();
+    auto moved = ::MoveFileExW(path_.raw(), rotated.raw(), MOVEFILE_WRITE_THROUGH);
+    if (!moved) {
+      reopen();
+      retry_ms_ = ::GetTickCount64() + kRotateRetryMs;
+      return;
+    }
+    auto rotated_index = path_.parent().append(ChangeExt(segment, kIndexExt));
+    ::MoveFileExW(index_path().raw(), rotated_index.raw(), MOVEFILE_WRITE_THROUGH);
+    bytes_ = 0;
+    reopen();
+    opened_ms_ = ::GetTickCount64();
+    has_records_ = false;
+    archiver_->kick();
+  }
+
+  // Opens the log and its index for appending. Only a new log starts with a
+  // session record, an old one that could not be renamed just goes on.
+  bool reopen() {
+    file_ = plx::File::Create(
+        path_, plx::FileParams::Append_SharedRead(), plx::FileSecurity());
+    if (!file_.is_valid())
+      return false;
+    bytes_ = file_.size_in_bytes();
+    index_.open(index_path(), bytes_);
+    if (!bytes_)
+      bytes_ += write_session();
+    return true;
   }
+
+  std::wstring base_name() const {
+    auto leaf = path_.leaf();
+    return leaf.substr(0, leaf.find_last_of(L'.'));
+  }
+
+  plx::FilePath index_path() const {
+    return path_.parent().append(base_name() + kIndexExt);
+  }
+
+  void write_out(const uint8_t* buf, size_t size) {
+    // A failed rotation, try to get the file back.
+    if (!file_.is_valid() && !reopen())
+      return;
+    bytes_ += file_.write(buf, size, -1);
+    has_records_ = true;
+  }
+
+  void flush_loop() {
+    std::vector<LogLine*> batch;
+    std::vector<LogRing*> rings;
+    std::vector<size_t> taken;
+    std::unique_ptr<uint8_t[]> out(new uint8_t[kOutSize]);
+
+    while (true) {
+      auto stopping = stop_.load();
+      // Read before the rings so the records that asked for it are in.
+      auto urgent = urgent_.exchange(false);
+
+      {
+        std::lock_guard<std::mutex> guard(rings_lock_);
+        rings.clear();
+        for (auto& ring : rings_)
+          rings.push_back(ring.get());
+      }
+
+      // The records of every ring are already in order, sorting merges them.
+      batch.clear();
+      taken.assign(rings.size(), 0);
+      for (size_t ix = 0; ix != rings.size(); ++ix) {
+        while (auto line = rings[ix]->peek(taken[ix])) {
+          batch.push_back(line);
+          ++taken[ix];
+        }
+      }
+      std::sort(begin(batch), end(batch),
+          [](const LogLine* l, const LogLine* r) { return l->seq < r->seq; });
+
+      size_t used = 0;
+      for (auto line : batch) {
+        if (used + line->size > kOutSize) {
+          write_out(out.get(), used);
+          used = 0;
+        }
+        index_.add(bytes_ + used, line->data);
+        memcpy(out.get() + used, line->data, line->size);
+        used += line->size;
+      }
+      auto dropped = dropped_.exchange(0);
+      if (dropped && (used + 64 <= kOutSize)) {
+        RecordBuilder rb(out.get() + used, 64, LogEvent::dropped, Ticks());
+        rb.arg(int(dropped));
+        auto size = rb.finish();
+        index_.add(bytes_ + used, out.get() + used);
+        used += size;
+      }
+      if (used)
+        write_out(out.get(), used);
+      unsynced_ += batch.size();
+      if (needs_sync(stopping, urgent))
+        sync();
+      if (needs_rotation())
+        rotate();
+
+      for (size_t ix = 0; ix != rings.size(); ++ix)
+        rings[ix]->pop(taken[ix]);
+
+      if (stopping) {
+        index_.close();
+        return;
+      }
+      ::WaitForSingleObject(wake_, 50);
+    }
+  }
+
+  static const size_t kOutSize = 64 * 1024;
+  static const size_t kWakeAt = 256;
 };
 
-static Logger* elg = nullptr;
+std::atomic<unsigned long long> Logger::generations(0);
+__declspec(thread) LogRing* Logger::th_ring = nullptr;
+__declspec(thread) unsigned long long Logger::th_generation = 0;
+
+// Set by Log::init() and cleared by Log::close().
+static std::atomic<Logger*> elg(nullptr);
+// The Log calls using the logger right now.
+static std::atomic<long> elg_users(0);
+
+// Keeps the logger alive while a Log call uses it. Counting the user before
+// loading |elg| means that once close() has cleared |elg| and seen no
+// users, no call can still get to the logger.
+class LoggerRef {
+  Logger* lg_;
+
+  LoggerRef(const LoggerRef&) = delete;
+  LoggerRef& operator=(const LoggerRef&) = delete;
+
+public:
+  LoggerRef() {
+    ++elg_users;
+    lg_ = elg.load();
+  }
+
+  ~LoggerRef() {
+    --elg_users;
+  }
+
+  explicit operator bool() const {
+    return lg_ != nullptr;
+  }
+
+  Logger* operator->() const {
+    return lg_;
+  }
+};
 
 void Log::init(const wchar_t * name) {
   if (elg)
@@ -73,39 +844,84 @@ void Log::init(const wchar_t * name) {
 
   auto appdata_path = plx::GetAppDataPath(false);
   auto path = appdata_path.append(name);
-  elg = new Logger(path);
-  elg->add("\n@ plex log <plexmon> [0.1] " __DATE__ " now : ");
-  elg->add_now_readable();
-  elg->add(spf("%lu pid %d tid %d tick %llu\n", elg->ts(),
-      ::GetCurrentProcessId(), ::GetCurrentThreadId(), ::GetTickCount64()));
+  auto logger = new Logger(path);
+  logger->emit(LogEvent::init, ::GetCurrentProcessId());
+  elg = logger;
 }
 
 void Log::close() {
-  if (!elg)
+  auto logger = elg.exchange(nullptr);
+  if (!logger)
     return;
-  elg->add(spf("%lu endlog pid %d\n",
-      elg->ts(), ::GetCurrentProcessId()));
-  elg->add("@ log end\n");
-  delete elg;
-  elg = nullptr;
+  // Calls from other threads that got the logger before it was taken away
+  // finish their record first.
+  while (elg_users.load())
+    ::SwitchToThread();
+  logger->emit(LogEvent::close, ::GetCurrentProcessId());
+  delete logger;
 }
 
-//  elg->add(spf("%lu xx \n", elg->ts()));
+void Log::set_sync(const LogSync& sync) {
+  LoggerRef lg;
+  if (lg)
+    lg->set_sync(sync);
+}
 
 void Log::soft_fail(SoftFailure what, int line) {
-  elg->add(spf("%lu soft_fail line %d issue %s \n", elg->ts(), line, ToString(what)));
+  LoggerRef lg;
+  if (lg)
+    lg->emit(LogEvent::soft_fail, line, ToString(what));
 }
 
 void Log::hard_fail(HardFailure what, int line) {
-  elg->add(spf("%lu hard_fail line %d issue %s \n", elg->ts(), line, ToString(what)));
+  LoggerRef lg;
+  if (lg) {
+    // What comes next might be a crash, don't leave this one in the cache.
+    lg->emit(LogEvent::hard_fail, line, ToString(what));
+    lg->sync_soon();
+  }
 }
 
 void Log::installing(const plx::Version & v) {
-  elg->add(spf("%lu installing ver %s\n", elg->ts(), v.to_string().c_str()));
+  LoggerRef lg;
+  if (lg)
+    lg->emit(LogEvent::installing, v);
 }
 
 void Log::newer_found(const plx::Version & v) {
-  elg->add(spf("%lu newer_found ver %s\n", elg->ts(), v.to_string().c_str()));
+  LoggerRef lg;
+  if (lg)
+    lg->emit(LogEvent::newer_found, v);
+}
+
+void Log::rolled_back(const plx::Version & v) {
+  LoggerRef lg;
+  if (lg)
+    lg->emit(LogEvent::rolled_back, v);
+}
+
+void Log::delta_built(long long reused, long long fetched) {
+  LoggerRef lg;
+  if (lg)
+    lg->emit(LogEvent::delta_built, reused, fetched);
+}
+
+void Log::handshake(bool ok, long long ns) {
+  LoggerRef lg;
+  if (lg)
+    lg->emit(LogEvent::handshake, ok ? "ok" : "failed", ns);
+}
+
+void Log::process_new(unsigned long pid) {
+  LoggerRef lg;
+  if (lg)
+    lg->emit(LogEvent::process_new, pid);
+}
+
+void Log::process_exit(unsigned long pid, unsigned long code, bool normal) {
+  LoggerRef lg;
+  if (lg)
+    lg->emit(LogEvent::process_exit, pid, code, normal ? "normal" : "abnormal");
 }
 
 
@@ -0,0 +1,566 @@
+// plexlogdec.cpp.
+//
+// Renders the binary logs written by plexlog.cpp as text, or as one json
+// object per line. The session records carry the event names, formats and
+// clock so this does not depend on the version that wrote the log.
+
+#include "stdafx.h"
+#include "plexmon.h"
+#include "plexlogfmt.h"
+
+namespace {
+
+struct Arg {
+  char tag;
+  long long num;
+  std::string str;
+};
+
+struct EventFormat {
+  std::string name;
+  std::string format;
+};
+
+struct Session {
+  long long freq;
+  long long wall;
+  uint64_t ticks;
+  std::map<long long, EventFormat> events;
+};
+
+template <typename T>
+bool Take(plx::Range<const uint8_t>& r, T* v) {
+  if (r.size() < sizeof(T))
+    return false;
+  memcpy(v, r.start(), sizeof(T));
+  r.advance(sizeof(T));
+  return true;
+}
+
+bool ReadArgs(plx::Range<const uint8_t> r, std::vector<Arg>* args) {
+  args->clear();
+  while (!r.empty()) {
+    Arg arg = { char(r[0]), 0 };
+    r.advance(1);
+    switch (arg.tag) {
+      case 'i': {
+        int32_t v;
+        if (!Take(r, &v))
+          return false;
+        arg.num = v;
+        break;
+      }
+      case 'u': {
+        uint32_t v;
+        if (!Take(r, &v))
+          return false;
+        arg.num = v;
+        break;
+      }
+      case 'I': {
+        if (!Take(r, &arg.num))
+          return false;
+        break;
+      }
+      case 's': {
+        uint8_t len;
+        if (!Take(r, &len) || (r.size() < len))
+          return false;
+        arg.str.assign(reinterpret_cast<const char*>(r.start()), len);
+        r.advance(len);
+        break;
+      }
+      case 'v': {
+        uint16_t v[4];
+        if (!Take(r, &v))
+          return false;
+        char buf[24];
+        auto len = PLX_FORMAT_TO(plx::RangeFromArray(buf), "%u.%u.%u.%u",
+                                 v[0], v[1], v[2], v[3]);
+        arg.str.assign(buf, len);
+        break;
+      }
+      default:
+        return false;
+    }
+    args->push_back(arg);
+  }
+  return true;
+}
+
+bool ReadSession(const RecordHeader& rh, const std::vector<Arg>& args,
+                 Session* session) {
+  if ((args.size() < 3) || (args[0].str != kLogMagic) || (args[1].num <= 0))
+    return false;
+  session->freq = args[1].num;
+  session->wall = args[2].num;
+  session->ticks = rh.ticks;
+  session->events.clear();
+  for (size_t ix = 3; ix + 2 < args.size(); ix += 3) {
+    EventFormat ef = { args[ix + 1].str, args[ix + 2].str };
+    session->events[args[ix].num] = ef;
+  }
+  return true;
+}
+
+// The per-record text below is formatted into stack buffers and appended to
+// the output, so decoding a large log does not allocate per record.
+
+// The FILETIME of a record.
+long long RecordWall(const Session& session, uint64_t ticks) {
+  // Split the division so the multiplication can't overflow.
+  auto delta = static_cast<long long>(ticks - session.ticks);
+  auto ns100 = ((delta / session.freq) * 10000000LL) +
+               (((delta % session.freq) * 10000000LL) / session.freq);
+  return session.wall + ns100;
+}
+
+void AppendWallTime(const Session& session, uint64_t ticks, std::string* out) {
+  ULARGE_INTEGER ul;
+  ul.QuadPart = RecordWall(session, ticks);
+  FILETIME ft = { ul.LowPart, ul.HighPart };
+  SYSTEMTIME st;
+  if (!::FileTimeToSystemTime(&ft, &st)) {
+    out->push_back('?');
+    return;
+  }
+  // The records have sub-microsecond ticks, SYSTEMTIME stops at ms.
+  auto us = static_cast<int>((ul.QuadPart % 10000000ULL) / 10);
+  char buf[32];
+  out->append(buf, PLX_FORMAT_TO(plx::RangeFromArray(buf),
+      "%04d-%02d-%02d %02d:%02d:%02d.%06d",
+      st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, us));
+}
+
+void AppendArg(const Arg& arg, std::string* out) {
+  if ((arg.tag == 's') || (arg.tag == 'v')) {
+    out->append(arg.str);
+    return;
+  }
+  char buf[24];
+  out->append(buf, PLX_FORMAT_TO(plx::RangeFromArray(buf), "%lld", arg.num));
+}
+
+void AppendJsonString(const std::string& str, std::string* out) {
+  out->push_back('\"');
+  for (auto c : str) {
+    switch (c) {
+      case '\"': out->append("\\\""); break;
+      case '\\': out->append("\\\\"); break;
+      case '\n': out->append("\\n"); break;
+      case '\r': out->append("\\r"); break;
+      case '\t': out->append("\\t"); break;
+      default:
+        if (uint8_t(c) < 32) {
+          char buf[8];
+          out->append(buf, PLX_FORMAT_TO(plx::RangeFromArray(buf),
+                                         "\\u%04x", uint8_t(c)));
+        } else {
+          out->push_back(c);
+        }
+    }
+  }
+  out->push_back('\"');
+}
+
+// The formats only tell where arguments go, their type comes from the tag.
+void AppendRendered(const std::string& format, const std::vector<Arg>& args,
+                    std::string* out) {
+  size_t next = 0;
+  for (size_t ix = 0; ix < format.size(); ++ix) {
+    if (format[ix] != '%') {
+      out->push_back(format[ix]);
+      continue;
+    }
+    if ((ix + 1 < format.size()) && (format[ix + 1] == '%')) {
+      out->push_back('%');
+      ++ix;
+      continue;
+    }
+    while ((ix + 1 < format.size()) && !isalpha(uint8_t(format[ix + 1])))
+      ++ix;
+    while ((ix + 1 < format.size()) && strchr("hlLzjt", format[ix + 1]))
+      ++ix;
+    ++ix;
+    if (next < args.size())
+      AppendArg(args[next++], out);
+    else
+      out->push_back('?');
+  }
+}
+
+void AppendTextLine(const Session& session, const RecordHeader& rh,
+                    const std::vector<Arg>& args, std::string* out) {
+  char buf[32];
+  AppendWallTime(session, rh.ticks, out);
+  out->append(buf, PLX_FORMAT_TO(plx::RangeFromArray(buf), " tid %u ", rh.tid));
+  auto it = session.events.find(rh.event);
+  if (it == end(session.events))
+    out->append(buf, PLX_FORMAT_TO(plx::RangeFromArray(buf), "event %d", rh.event));
+  else
+    AppendRendered(it->second.format, args, out);
+  out->push_back('\n');
+}
+
+void AppendJsonLine(const Session& session, const RecordHeader& rh,
+                    const std::vector<Arg>& args, std::string* out) {
+  char buf[32];
+  out->append("{\"time\": \"");
+  AppendWallTime(session, rh.ticks, out);
+  out->append(buf, PLX_FORMAT_TO(plx::RangeFromArray(buf),
+      "\", \"tid\": %u, \"event\": ", rh.tid));
+  auto it = session.events.find(rh.event);
+  if (it == end(session.events))
+    out->append(buf, PLX_FORMAT_TO(plx::RangeFromArray(buf), "\"%d\"", rh.event));
+  else
+    AppendJsonString(it->second.name, out);
+  out->append(", \"args\": [");
+  for (size_t ix = 0; ix != args.size(); ++ix) {
+    if (ix)
+      out->append(", ");
+    auto& arg = args[ix];
+    if ((arg.tag == 's') || (arg.tag == 'v'))
+      AppendJsonString(arg.str, out);
+    else
+      AppendArg(arg, out);
+  }
+  out->append("]}\n");
+}
+
+// Rotated logs are compressed in independent blocks, see LogArchiver.
+bool Unarchive(plx::Range<const uint8_t> data, std::vector<uint8_t>* out) {
+  uint32_t header[2];
+  if (!Take(data, &header) ||
+      (header[0] != kArchiveMagic) || (header[1] != kArchiveFormat))
+    return false;
+  plx::BlockCodec codec;
+  while (!data.empty()) {
+    uint32_t sizes[2];
+    if (!Take(data, &sizes) || !sizes[0] || !sizes[1] || (data.size() < sizes[1]))
+      return false;
+    auto at = out->size();
+    out->resize(at + sizes[0]);
+    plx::Range<uint8_t> block(&(*out)[at], sizes[0]);
+    if (!codec.decompress(data.slice(0, sizes[1]), block))
+      return false;
+    data.advance(sizes[1]);
+  }
+  return true;
+}
+
+// Lays out a flight recorder file as a log: its session record and then
+// the records of the slots in sequence order. Slots that were being
+// written when the process died have no sequence number and are skipped.
+bool Unwind(plx::Range<const uint8_t> data, std::vector<uint8_t>* out) {
+  RecorderHeader header;
+  auto all = data;
+  if (!Take(data, &header) ||
+      (header.magic != kRecorderMagic) || (header.format != kRecorderFormat))
+    return false;
+  if ((header.slot_size <= sizeof(uint64_t) + sizeof(RecordHeader)) ||
+      (header.data_offset < sizeof(header) + header.session_size) ||
+      (all.size() < header.data_offset +
+                    (uint64_t(header.slot_size) * header.slot_count)))
+    return false;
+
+  auto session = data.start();
+  out->assign(session, session + header.session_size);
+
+  std::vector<std::pair<uint64_t, const uint8_t*>> records;
+  auto slot = all.start() + header.data_offset;
+  for (uint32_t ix = 0; ix != header.slot_count; ++ix, slot += header.slot_size) {
+    uint64_t seq;
+    RecordHeader rh;
+    memcpy(&seq, slot, sizeof(seq));
+    memcpy(&rh, slot + sizeof(seq), sizeof(rh));
+    if (!seq || (rh.size < sizeof(rh)) || (rh.size > header.slot_size - sizeof(seq)))
+      continue;
+    records.emplace_back(seq, slot + sizeof(seq));
+  }
+  std::sort(begin(records), end(records));
+  for (auto& rec : records) {
+    RecordHeader rh;
+    memcpy(&rh, rec.second, sizeof(rh));
+    out->insert(end(*out), rec.second, rec.second + rh.size);
+  }
+  return true;
+}
+
+bool HasMagic(const plx::Range<const uint8_t>& data, uint32_t magic) {
+  uint32_t got;
+  if (data.size() < sizeof(got))
+    return false;
+  memcpy(&got, data.start(), sizeof(got));
+  return (got == magic);
+}
+
+// Maps |path| and unpacks it if needed. |offsets| tells if the offsets in
+// |data| are those of the file, which is what the time index refers to.
+bool LoadLog(const plx::FilePath& path, plx::MappedFile* mapped,
+             std::vector<uint8_t>* unpacked, plx::Range<const uint8_t>* data,
+             bool* offsets) {
+  auto log = plx::File::Create(
+      path, plx::FileParams::Read_ShareAll(), plx::FileSecurity());
+  if (!log.is_valid())
+    return false;
+  *mapped = plx::MappedFile::Create(log);
+  *data = mapped->view();
+  *offsets = true;
+
+  if (HasMagic(*data, kArchiveMagic)) {
+    if (!plx::BlockCodec::available() || !Unarchive(*data, unpacked))
+      return false;
+  } else if (HasMagic(*data, kRecorderMagic)) {
+    if (!Unwind(*data, unpacked))
+      return false;
+  } else {
+    return true;
+  }
+  *offsets = false;
+  *data = plx::Range<const uint8_t>();
+  if (!unpacked->empty())
+    *data = plx::RangeFromVector(*unpacked);
+  return true;
+}
+
+bool Wanted(const LogQuery* query, const Session& session,
+            const RecordHeader& rh) {
+  if (!query)
+    return true;
+  auto wall = RecordWall(session, rh.ticks);
+  if ((wall < query->from) || (wall > query->to))
+    return false;
+  if (query->event.empty())
+    return true;
+  auto it = session.events.find(rh.event);
+  return (it != end(session.events)) && (it->second.name == query->event);
+}
+
+// Renders the records in |data| that |query| wants, all of them without
+// one. |session| is the session in effect, it carries over between calls
+// and has a zero |freq| until there is one.
+bool RenderRecords(plx::Range<const uint8_t> data, bool json,
+                   const LogQuery* query, Session* session, std::string* out) {
+  std::vector<Arg> args;
+  while (data.size() >= sizeof(RecordHeader)) {
+    RecordHeader rh;
+    memcpy(&rh, data.start(), sizeof(rh));
+    // A short record is the tail of a log still being written.
+    if ((rh.size < sizeof(rh)) || (rh.size > data.size()))
+      break;
+    plx::Range<const uint8_t> body(data.start() + sizeof(rh), rh.size - sizeof(rh));
+    data.advance(rh.size);
+    if (!ReadArgs(body, &args))
+      return false;
+
+    if (rh.event == 0) {
+      if (!ReadSession(rh, args, session))
+        return false;
+      if (query)
+        continue;
+      out->append(json ? "{\"time\": \"" : "@ session ");
+      AppendWallTime(*session, rh.ticks, out);
+      out->append(json ? "\", \"event\": \"session\"}\n" : "\n");
+      continue;
+    }
+    if (!session->freq)
+      return false;
+    if (!Wanted(query, *session, rh))
+      continue;
+    if (json)
+      AppendJsonLine(*session, rh, args, out);
+    else
+      AppendTextLine(*session, rh, args, out);
+  }
+  return true;
+}
+
+// Reads the session record at |offset|, as named by a time index entry.
+bool SessionAt(plx::Range<const uint8_t> data, long long offset, Session* session) {
+  if ((offset < 0) || (uint64_t(offset) + sizeof(RecordHeader) > data.size()))
+    return false;
+  data.advance(static_cast<size_t>(offset));
+  RecordHeader rh;
+  memcpy(&rh, data.start(), sizeof(rh));
+  if ((rh.event != 0) || (rh.size < sizeof(rh)) || (rh.size > data.size()))
+    return false;
+  std::vector<Arg> args;
+  plx::Range<const uint8_t> body(data.start() + sizeof(rh), rh.size - sizeof(rh));
+  return ReadArgs(body, &args) && ReadSession(rh, args, session);
+}
+
+// False if there is no index or it does not describe a log of |log_size|
+// bytes, the whole log is read then.
+bool ReadTimeIndex(const plx::FilePath& path, long long log_size,
+                   TimeIndexHeader* header, std::vector<TimeIndexEntry>* entries) {
+  auto leaf = path.leaf();
+  auto index_path = path.parent().append(
+      leaf.substr(0, leaf.find_last_of(L'.')) + L".pxi");
+  auto file = plx::File::Create(
+      index_path, plx::FileParams::Read_ShareAll(), plx::FileSecurity());
+  if (!file.is_valid())
+    return false;
+  auto hr = plx::RangeFromBytes(header, sizeof(*header));
+  if (file.read(hr, 0) != sizeof(*header))
+    return false;
+  if ((header->magic != kIndexMagic) || (header->format != kIndexFormat) ||
+      (header->base < 0) || (header->base > log_size))
+    return false;
+
+  // The logger could be in the middle of appending the last entry.
+  auto count = (file.size_in_bytes() - sizeof(*header)) / sizeof(TimeIndexEntry);
+  entries->resize(plx::To<size_t>(count));
+  if (entries->empty())
+    return true;
+  auto er = plx::RangeFromVector(*entries).bytes();
+  if (file.read(er, sizeof(*header)) != er.size())
+    return false;
+
+  auto offset = header->base;
+  for (auto& entry : *entries) {
+    if ((entry.offset < offset) || (entry.session_offset >= entry.offset) ||
+        (entry.offset + entry.size > log_size))
+      return false;
+    offset = entry.offset + entry.size;
+  }
+  return true;
+}
+
+// Blocks without the event can be passed over. Ids past the mask bits are
+// not tracked, those blocks are read.
+bool MayHaveEvent(const Session& session, uint64_t events, const std::string& name) {
+  for (auto& ev : session.events) {
+    if (ev.second.name != name)
+      continue;
+    return (ev.first >= 64) || ((events & (1ULL << ev.first)) != 0);
+  }
+  return false;
+}
+
+bool WriteOutput(const plx::FilePath& path, const wchar_t* ext,
+                 const std::string& out) {
+  std::wstring out_path(path.raw());
+  out_path.append(ext);
+  auto op = plx::FileParams::Write_Exclusive(CREATE_ALWAYS);
+  auto file = plx::File::Create(plx::FilePath(out_path), op, plx::FileSecurity());
+  if (!file.is_valid())
+    return false;
+  return file.write(plx::RangeFromString(out)) == out.size();
+}
+
+}
+
+bool DecodeLog(const plx::FilePath& path, bool json) {
+  plx::MappedFile mapped;
+  std::vector<uint8_t> unpacked;
+  plx::Range<const uint8_t> data;
+  bool offsets;
+  if (!LoadLog(path, &mapped, &unpacked, &data, &offsets))
+    return false;
+
+  std::string out;
+  Session session = {};
+  if (!RenderRecords(data, json, nullptr, &session, &out))
+    return false;
+  return WriteOutput(path, json ? L".json" : L".txt", out);
+}
+
+bool QueryLog(const plx::FilePath& path, const LogQuery& query, bool json) {
+  plx::MappedFile mapped;
+  std::vector<uint8_t> unpacked;
+  plx::Range<const uint8_t> data;
+  bool offsets;
+  if (!LoadLog(path, &mapped, &unpacked, &data, &offsets))
+    return false;
+
+  auto ext = json ? L".query.json" : L".query.txt";
+  std::string out;
+  Session session = {};
+  TimeIndexHeader header;
+  std::vector<TimeIndexEntry> entries;
+  auto size = plx::To<long long>(data.size());
+  if (!offsets || !ReadTimeIndex(path, size, &header, &entries)) {
+    if (!RenderRecords(data, json, &query, &session, &out))
+      return false;
+    return WriteOutput(path, ext, out);
+  }
+
+  // What was logged before the index existed.
+  auto base = static_cast<size_t>(header.base);
+  if (base && !RenderRecords(data.slice(0, base), json, &query, &session, &out))
+    return false;
+
+  long long session_offset = -1;
+  auto end_offset = header.base;
+  for (auto& entry : entries) {
+    end_offset = entry.offset + entry.size;
+    if ((entry.last_wall < query.from) || (entry.first_wall > query.to))
+      continue;
+    if (entry.session_offset != session_offset) {
+      if (!SessionAt(data, entry.session_offset, &session))
+        return false;
+      session_offset = entry.session_offset;
+    }
+    if (!query.event.empty() && !MayHaveEvent(session, entry.events, query.event))
+      continue;
+    plx::Range<const uint8_t> block(data.start() + entry.offset, entry.size);
+    if (!RenderRecords(block, json, &query, &session, &out))
+      return false;
+  }
+
+  // The records after the last full block.
+  if (!entries.empty() && (entries.back().session_offset != session_offset)) {
+    if (!SessionAt(data, entries.back().session_offset, &session))
+      return false;
+  }
+  auto tail = static_cast<size_t>(end_offset);
+  if (tail < data.size()) {
+    plx::Range<const uint8_t> rest(data.start() + tail, data.size() - tail);
+    if (!RenderRecords(rest, json, &query, &session, &out))
+      return false;
+  }
+  return WriteOutput(path, ext, out);
+}
+
+bool ParseLogTime(const plx::Range<const wchar_t>& text, long long* filetime) {
+  // Year, month, day, hour, minute, second and 100ns units, each with the
+  // separator that ends it.
+  const wchar_t kSeparators[] = { L'-', L'-', L'T', L':', L':', L'.' };
+  uint32_t fields[7] = {};
+  int digits[7] = {};
+  size_t ix = 0;
+  for (auto c : text) {
+    if ((c >= L'0') && (c <= L'9')) {
+      if ((ix == 6) && (digits[ix] == 7))
+        continue;
+      if (digits[ix] == 9)
+        return false;
+      fields[ix] = (fields[ix] * 10) + (c - L'0');
+      ++digits[ix];
+    } else if ((ix < 6) && digits[ix] &&
+               ((c == kSeparators[ix]) || ((ix == 2) && (c == L' ')))) {
+      ++ix;
+    } else {
+      return false;
+    }
+  }
+  if ((ix < 2) || !digits[ix])
+    return false;
+  for (int d = digits[6]; (ix == 6) && (d != 7); ++d)
+    fields[6] *= 10;
+  for (size_t f = 0; f != 6; ++f) {
+    if (fields[f] > 0xFFFF)
+      return false;
+  }
+
+  SYSTEMTIME st = {
+    WORD(fields[0]), WORD(fields[1]), 0, WORD(fields[2]),
+    WORD(fields[3]), WORD(fields[4]), WORD(fields[5]), 0
+  };
+  FILETIME ft;
+  if (!::SystemTimeToFileTime(&st, &ft))
+    return false;
+  ULARGE_INTEGER ul = { ft.dwLowDateTime, ft.dwHighDateTime };
+  *filetime = static_cast<long long>(ul.QuadPart) + fields[6];
+  return true;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+// The on-disk formats of the log files, shared by the logger in plexlog.cpp
+// and the decoder in plexlogdec.cpp. Changing any of these needs a new
+// format number.
+
+// A log (.pxl) is a sequence of records, each one starts with a RecordHeader
+// followed by tagged arguments:
+//   'i' int32, 'u' uint32, 'I' int64, 's' uint8 length + chars,
+//   'v' four uint16 (a version).
+// Every logging session starts with a session record, event 0, whose first
+// argument is |kLogMagic|.
+const char kLogMagic[] = "pxlg1";
+
+#pragma pack(push, 1)
+struct RecordHeader {
+  uint16_t size;      // Including the header.
+  uint16_t event;
+  uint32_t tid;
+  uint64_t ticks;     // plx::Clock, the session record has the frequency.
+};
+#pragma pack(pop)
+
+// A compressed segment (.pxz) is 'pxlz' + format followed by blocks of
+// { uint32 raw size, uint32 compressed size, data }.
+const uint32_t kArchiveMagic = 0x7a6c7870;    // 'pxlz'
+const uint32_t kArchiveFormat = 1;
+
+// A flight recorder (.pxr) is this header, the session record and then
+// |slot_count| slots of { uint64 seq, record } at |data_offset|.
+const uint32_t kRecorderMagic = 0x72667870;   // 'pxfr'
+const uint32_t kRecorderFormat = 1;
+
+struct RecorderHeader {
+  uint32_t magic;
+  uint32_t format;
+  uint32_t slot_size;
+  uint32_t slot_count;
+  uint32_t data_offset;
+  uint32_t session_size;
+};
+
+// A time index (.pxi) is a header and then one entry for every block of
+// records of the log. The log before |base| predates the index.
+const uint32_t kIndexMagic = 0x69747870;      // 'pxti'
+const uint32_t kIndexFormat = 1;
+
+struct TimeIndexHeader {
+  uint32_t magic;
+  uint32_t format;
+  long long base;
+};
+
+struct TimeIndexEntry {
+  long long offset;           // First record of the block.
+  long long session_offset;   // The session record the block belongs to.
+  long long first_wall;       // FILETIME of the earliest record.
+  long long last_wall;        // FILETIME of the latest record.
+  uint64_t events;            // Bit |event| is set if the block has one.
+  uint32_t size;
+  uint32_t count;
+};
@@ -0,0 +1,279 @@
+// plexmanifest.cpp.
+//
+// The .what file is a json manifest published with each version:
+// { "files": { "plexmon.exe": { "size": 1234, "sha256": "<hex>" }, ... } }
+
+#include "stdafx.h"
+#include "plexmon.h"
+
+namespace {
+
+// Files this size or bigger are hashed through a mapped view.
+const long long kMapThreshold = 1024 * 1024;
+const size_t kHashStep = 64 * 1024 * 1024;
+const size_t kReadBuffer = 256 * 1024;
+
+// Runs |fn(ix)| for every ix in [0, count) using up to one thread per core.
+// |fn| must not throw.
+template <typename Fn>
+void ParallelFor(size_t count, Fn fn) {
+  size_t cores = std::max(1U, std::thread::hardware_concurrency());
+  auto workers = std::min(count, cores);
+  std::atomic<size_t> next(0);
+  auto work = [&] {
+    while (true) {
+      auto ix = next++;
+      if (ix >= count)
+        return;
+      fn(ix);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t ix = 1; ix < workers; ++ix)
+    threads.emplace_back(work);
+  work();
+  for (auto& th : threads)
+    th.join();
+}
+
+bool ValidName(const std::wstring& name) {
+  if (name.empty() || (name == L".") || (name == L".."))
+    return false;
+  return name.find_first_of(L"\\/:") == std::wstring::npos;
+}
+
+// Pulls json tokens from a file, reading it as the reader asks for more.
+class JsonFileReader {
+  plx::File& file_;
+  plx::JsonReader reader_;
+  std::unique_ptr<uint8_t[]> buf_;
+
+public:
+  explicit JsonFileReader(plx::File& file)
+      : file_(file), buf_(new uint8_t[kReadBuffer]) {
+  }
+
+  plx::JsonToken next() {
+    for (;;) {
+      auto token = reader_.next();
+      if (token != plx::JsonToken::MORE)
+        return token;
+      more();
+    }
+  }
+
+  // Leaves out the value that comes next, whatever it is.
+  void skip_value() {
+    auto token = next();
+    if ((token == plx::JsonToken::BEGIN_OBJECT) ||
+        (token == plx::JsonToken::BEGIN_ARRAY)) {
+      while (!reader_.skip())
+        more();
+    }
+  }
+
+  bool key_is(const char* key) const {
+    auto k = reader_.get_range();
+    return (k.size() == strlen(key)) && (memcmp(k.start(), key, k.size()) == 0);
+  }
+
+  const plx::JsonReader& reader() const {
+    return reader_;
+  }
+
+private:
+  void more() {
+    auto rd = file_.read(buf_.get(), kReadBuffer, -1);
+    if (!rd) {
+      reader_.finish();
+      return;
+    }
+    reader_.feed(reinterpret_cast<const char*>(buf_.get()), rd);
+  }
+};
+
+// Reads { "size": n, "sha256": "<hex>" }, other members are ignored.
+bool ReadManifestEntry(JsonFileReader& json, ManifestEntry* entry) {
+  using T = plx::JsonToken;
+  if (json.next() != T::BEGIN_OBJECT)
+    return false;
+  bool has_size = false;
+  bool has_sha = false;
+  for (auto token = json.next(); token != T::END_OBJECT; token = json.next()) {
+    if (json.key_is("size")) {
+      if (json.next() != T::INT64)
+        return false;
+      entry->size = json.reader().get_int64();
+      has_size = true;
+    } else if (json.key_is("sha256")) {
+      if (json.next() != T::STRING)
+        return false;
+      if (!plx::Sha256::FromHex(json.reader().get_string(), &entry->sha256))
+        return false;
+      has_sha = true;
+    } else {
+      json.skip_value();
+    }
+  }
+  return has_size && has_sha;
+}
+
+// A mapped view that cannot be paged in, because the file got truncated or
+// the volume went away, raises EXCEPTION_IN_PAGE_ERROR instead of failing a
+// read. That is a structured exception so it is caught here; __try does not
+// allow objects that need unwinding in the same function.
+bool HashMappedView(plx::Sha256* sha, const uint8_t* start, size_t size) {
+  __try {
+    while (size) {
+      auto step = std::min(size, kHashStep);
+      sha->update(plx::Range<const uint8_t>(start, step));
+      start += step;
+      size -= step;
+    }
+  } __except (::GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ?
+              EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+    return false;
+  }
+  return true;
+}
+
+}
+
+bool HashFile(const plx::FilePath& path, ManifestEntry* entry) {
+  auto op = plx::FileParams::ReadSequential_SharedRead();
+  auto file = plx::File::Create(path, op, plx::FileSecurity());
+  if (!file.is_valid())
+    return false;
+
+  plx::Sha256 sha;
+  auto size = file.size_in_bytes();
+  if (size >= kMapThreshold) {
+    auto mapped = plx::MappedFile::Create(file);
+    auto view = mapped.view();
+    if (!HashMappedView(&sha, view.start(), view.size())) {
+      ::SetLastError(ERROR_READ_FAULT);
+      throw plx::IOException(__LINE__, path.raw());
+    }
+  } else {
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[kReadBuffer]);
+    long long total = 0;
+    while (auto rd = file.read(buf.get(), kReadBuffer, -1)) {
+      sha.update(plx::Range<const uint8_t>(buf.get(), rd));
+      total += rd;
+    }
+    if (total != size)
+      return false;
+  }
+
+  entry->size = size;
+  entry->sha256 = sha.finish();
+  return true;
+}
+
+bool ReadManifest(const plx::FilePath& dir, Manifest* manifest) {
+  auto op = plx::FileParams::ReadSequential_SharedRead();
+  auto what = plx::File::Create(dir.append(L".what"), op, plx::FileSecurity());
+  if (!what.is_valid())
+    return false;
+
+  // Streamed, the memory used does not grow with the number of files and
+  // only the entries themselves are kept.
+  using T = plx::JsonToken;
+  JsonFileReader json(what);
+  manifest->clear();
+  if (json.next() != T::BEGIN_OBJECT)
+    return false;
+  bool has_files = false;
+  for (auto token = json.next(); token != T::END_OBJECT; token = json.next()) {
+    if (!json.key_is("files")) {
+      json.skip_value();
+      continue;
+    }
+    if (has_files || (json.next() != T::BEGIN_OBJECT))
+      return false;
+    has_files = true;
+    for (token = json.next(); token != T::END_OBJECT; token = json.next()) {
+      auto name = plx::UTF16FromUTF8(json.reader().get_range().const_bytes(), true);
+      ManifestEntry entry;
+      if (!ValidName(name) || !ReadManifestEntry(json, &entry))
+        return false;
+      (*manifest)[name] = entry;
+    }
+  }
+  return has_files && (json.next() == T::END);
+}
+
+bool VerifyManifest(const plx::FilePath& dir, const Manifest& manifest) {
+  // Biggest files first so that one large file does not start last.
+  std::vector<Manifest::const_iterator> work;
+  for (auto it = begin(manifest); it != end(manifest); ++it)
+    work.push_back(it);
+  std::sort(begin(work), end(work),
+      [](Manifest::const_iterator l, Manifest::const_iterator r) {
+    return l->second.size > r->second.size;
+  });
+
+  std::atomic<bool> failed(false);
+  ParallelFor(work.size(), [&](size_t ix) {
+    if (failed)
+      return;
+    ManifestEntry got;
+    try {
+      if (HashFile(dir.append(work[ix]->first), &got) &&
+          (got.size == work[ix]->second.size) &&
+          (got.sha256 == work[ix]->second.sha256))
+        return;
+    } catch (plx::Exception&) {
+    }
+    failed = true;
+  });
+  return !failed;
+}
+
+bool WriteManifest(const plx::FilePath& dir) {
+  std::vector<std::wstring> names;
+  {
+    auto par = plx::FileParams::Directory_ShareAll();
+    auto dir_file = plx::File::Create(dir, par, plx::FileSecurity());
+    if (!dir_file.is_valid())
+      return false;
+    auto finf = plx::FilesInfo::Stream(dir_file, plx::FilesInfo::files_only);
+    for (finf.first(); !finf.done(); finf.next()) {
+      auto name = plx::WideStringFromRange(finf.file_name());
+      if (name != L".what")
+        names.push_back(name);
+    }
+  }
+
+  std::vector<ManifestEntry> entries(names.size());
+  std::atomic<bool> failed(false);
+  ParallelFor(names.size(), [&](size_t ix) {
+    try {
+      if (HashFile(dir.append(names[ix]), &entries[ix]))
+        return;
+    } catch (plx::Exception&) {
+    }
+    failed = true;
+  });
+  if (failed)
+    return false;
+
+  std::string json("{ \"files\": {\n");
+  for (size_t ix = 0; ix != names.size(); ++ix) {
+    auto name = plx::UTF8FromUTF16(plx::RangeFromString(names[ix]));
+    json.append(plx::StringPrintf(
+        "  \"%s\": { \"size\": %lld, \"sha256\": \"%s\" }%s\n",
+        name.c_str(), entries[ix].size,
+        plx::Sha256::ToHex(entries[ix].sha256).c_str(),
+        (ix + 1 == names.size()) ? "" : ","));
+  }
+  json.append("} }\n");
+
+  auto op = plx::FileParams::Write_Exclusive(CREATE_ALWAYS);
+  auto what = plx::File::Create(dir.append(L".what"), op, plx::FileSecurity());
+  if (!what.is_valid())
+    return false;
+  if (what.write(plx::RangeFromString(json)) != json.size())
+    return false;
+  return what.flush();
+}
@@ -8,6 +8,7 @@ extern "C" IMAGE_DOS_HEADER __ImageBase;
 
 const wchar_t job_obj_name[] = L"plxmon@vtx";
 const wchar_t install_pipe[] = L"plxmon@ins";
+const wchar_t op_log_name[] = L"vortex\\plexmon\\op_log.pxl";
 
 HINSTANCE ThisModule() {
   return reinterpret_cast<HINSTANCE>(&__ImageBase);
@@ -30,6 +31,7 @@ void HardfailMsgBox(HardFailure fail, int line) {
 struct Settings {
   plx::FilePath dropbox_root;
   std::string ping_url;
+  LogSync log_sync;
 
   Settings(std::wstring dropbox_root) : dropbox_root(dropbox_root) {}
 };
@@ -41,13 +43,41 @@ plx::File OpenConfigFile() {
   return plx::File::Create(path, fparams, plx::FileSecurity());
 }
 
+// "log_sync": { "mode": "none" | "interval" | "every_n", "ms": 1000,
+//               "records": 64 }, every member is optional.
+LogSync LogSyncFromJson(plx::JsonValue config) {
+  LogSync sync;
+  if (config.type() != plx::JsonType::OBJECT)
+    throw plx::IOException(__LINE__, L"<unexpected json>");
+  if (config.has_key("mode")) {
+    auto mode = config["mode"].get_string();
+    if (mode == "none")
+      sync.mode = LogSyncMode::none;
+    else if (mode == "interval")
+      sync.mode = LogSyncMode::interval;
+    else if (mode == "every_n")
+      sync.mode = LogSyncMode::every_n;
+    else
+      throw plx::IOException(__LINE__, L"<unexpected json>");
+  }
+  if (config.has_key("ms"))
+    sync.interval_ms = plx::To<unsigned int>(config["ms"].get_int64());
+  if (config.has_key("records"))
+    sync.records = plx::To<unsigned int>(config["records"].get_int64());
+  return sync;
+}
+
 Settings LoadSettings() {
-  auto config = plx::JsonFromFile(OpenConfigFile());
+  auto file = OpenConfigFile();
+  auto doc = plx::JsonDocument::FromFile(file);
+  auto& config = doc.root();
   if (config.type() != plx::JsonType::OBJECT)
     throw plx::IOException(__LINE__, L"<unexpected json>");
 
   auto db_str = config["dropbox_root"].get_string();
   Settings settings(plx::UTF16FromUTF8(plx::RangeFromString(db_str).bytes(), true));
+  if (config.has_key("log_sync"))
+    settings.log_sync = LogSyncFromJson(config["log_sync"]);
   return settings;
 }
 
@@ -60,68 +90,256 @@ std::wstring WideFromString(const std::string& str) {
   return std::wstring(begin(str), end(str));
 }
 
-bool FindHighestVersion(const plx::FilePath& dir_path, plx::Version* ver) {
-  auto par = plx::FileParams::Directory_ShareAll();
-  plx::File dir = plx::File::Create(dir_path, par, plx::FileSecurity());
-  if (!dir.is_valid()) {
-    Log::soft_fail(SoftFailure::invalid_dir, __LINE__);
-    return false;
-  }
+bool IsDeveloperBuild(const std::string& last_path) {
+  return (last_path == "Debug") || (last_path == "Release");
+}
 
-  plx::Version highest;
+plx::FilePath PlexmonExe(const plx::FilePath& path) {
+  return path.append(L"plexmon.exe");
+}
 
-  plx::FilesInfo finf = plx::FilesInfo::FromDir(dir, 10);
-  int count_dirs = 0;
-  for (finf.first(); !finf.done(); finf.next()) {
-    if (!finf.is_directory())
-      continue;
-    if (finf.file_name().empty())
-      continue;
-    if (finf.file_name()[0] == '.')
-      continue;
-    if (std::isalpha(finf.file_name()[0]))
-      continue;
-    auto name = plx::StringFromRange(finf.file_name());
-    auto version = plx::Version::FromRange(plx::RangeFromString(name));
-    if (plx::Version::Compare(version, highest) > 0)
-      highest = version;
-    ++count_dirs;
+// Checks that the manifest of a version directory is readable, lists the
+// binary and that every file is there with its listed size. A folder that
+// dropbox is still syncing fails here before anything gets copied. The
+// contents are verified against the digests when staged.
+bool ValidPlexmonDir(const plx::FilePath& path, Manifest* manifest) {
+  try {
+    if (!ReadManifest(path, manifest)) {
+      Log::soft_fail(SoftFailure::invalid_file, __LINE__);
+      return false;
+    }
+  } catch (plx::Exception&) {
+    Log::soft_fail(SoftFailure::invalid_file, __LINE__);
+    return false;
   }
 
-  if (!count_dirs)
+  if (manifest->find(L"plexmon.exe") == end(*manifest)) {
+    Log::soft_fail(SoftFailure::invalid_file, __LINE__);
     return false;
+  }
 
-  *ver = highest;
+  auto op = plx::FileParams::Read_SharedRead();
+  for (auto& entry : *manifest) {
+    auto file = plx::File::Create(path.append(entry.first), op, plx::FileSecurity());
+    if (!file.is_valid() || (file.size_in_bytes() != entry.second.size)) {
+      Log::soft_fail(SoftFailure::invalid_file, __LINE__);
+      return false;
+    }
+  }
   return true;
 }
 
-bool IsDeveloperBuild(const std::string& last_path) {
-  return (last_path == "Debug") || (last_path == "Release");
+// Deletes a directory and the files in it. Version directories are flat.
+void RemoveFlatDir(const plx::FilePath& dir) {
+  {
+    auto par = plx::FileParams::Directory_ShareAll();
+    auto dir_file = plx::File::Create(dir, par, plx::FileSecurity());
+    if (!dir_file.is_valid())
+      return;
+    auto finf = plx::FilesInfo::FromDir(dir_file);
+    for (finf.first(); !finf.done(); finf.next()) {
+      if (finf.is_directory())
+        continue;
+      ::DeleteFileW(dir.append(plx::WideStringFromRange(finf.file_name())).raw());
+    }
+  }
+  ::RemoveDirectoryW(dir.raw());
 }
 
-plx::FilePath PlexmonExe(const plx::FilePath& path) {
-  return path.append(L"plexmon.exe");
+bool FlushFile(const plx::FilePath& path) {
+  auto op = plx::FileParams::Write_Exclusive(OPEN_EXISTING);
+  auto file = plx::File::Create(path, op, plx::FileSecurity());
+  return file.is_valid() && file.flush();
 }
 
-bool ValidPlexmonDir(const plx::FilePath& path) {
-  auto op = plx::FileParams::Read_SharedRead();
-  auto exe = plx::File::Create(PlexmonExe(path), op, plx::FileSecurity());
-  if (!exe.is_valid()) {
-    Log::soft_fail(SoftFailure::invalid_file, __LINE__);
+// Builds the complete install in |staging|. Every file ends up flushed to
+// disk and checked against its digest.
+bool StageInstall(const plx::FilePath& db_dir, const plx::FilePath& staging,
+                  const Manifest& manifest) {
+  if (!::CreateDirectoryW(staging.raw(), NULL)) {
+    Log::soft_fail(SoftFailure::create_failed, __LINE__);
+    return false;
+  }
+
+  // Prefer rebuilding from the chunks we already have. Versions published
+  // without a chunk manifest get the full copy.
+  auto& exe_entry = manifest.find(L"plexmon.exe")->second;
+  DeltaStats delta;
+  if (BuildFromDelta(PlexmonExe(plx::GetExePath()), PlexmonExe(db_dir),
+                     PlexmonExe(staging), exe_entry.size, exe_entry.sha256,
+                     &delta)) {
+    Log::delta_built(delta.reused, delta.fetched);
+  } else if (!plx::CopyFileVerified(PlexmonExe(db_dir), PlexmonExe(staging),
+                                    exe_entry.size, exe_entry.sha256)) {
+    Log::soft_fail(SoftFailure::copy_failed, __LINE__);
     return false;
   }
-  auto what = plx::File::Create(path.append(L".what"), op, plx::FileSecurity());
-  if (!what.is_valid()) {
+
+  // The rest is copied by the kernel and then verified in parallel while
+  // it is still in the cache, so each source file is read once.
+  Manifest rest;
+  for (auto& entry : manifest) {
+    if ((entry.first == L"plexmon.exe") || (entry.first == L"plexmon.exe.chunks"))
+      continue;
+    auto to = staging.append(entry.first);
+    if (!::CopyFileW(db_dir.append(entry.first).raw(), to.raw(), TRUE) ||
+        !FlushFile(to)) {
+      Log::soft_fail(SoftFailure::copy_failed, __LINE__);
+      return false;
+    }
+    rest.insert(entry);
+  }
+  if (!VerifyManifest(staging, rest)) {
     Log::soft_fail(SoftFailure::invalid_file, __LINE__);
     return false;
   }
+
+  auto what = staging.append(L".what");
+  if (!::CopyFileW(db_dir.append(L".what").raw(), what.raw(), TRUE) ||
+      !FlushFile(what)) {
+    Log::soft_fail(SoftFailure::copy_failed, __LINE__);
+    return false;
+  }
   return true;
 }
 
-bool LaunchPlexmonInstall(const plx::FilePath& path) {
+// The new binary was just written so it is likely still cached, but the
+// loader faults it in page by page. One prefetch of each file avoids that.
+void PrefetchInstall(const plx::FilePath& install_dir, const Manifest& manifest) {
+  auto op = plx::FileParams::Read_SharedRead();
+  for (auto& entry : manifest) {
+    if (entry.first == L"plexmon.exe.chunks")
+      continue;
+    auto file = plx::File::Create(
+        install_dir.append(entry.first), op, plx::FileSecurity());
+    if (!file.is_valid())
+      continue;
+    try {
+      plx::MappedFile::Create(file).prefetch();
+    } catch (plx::Exception&) {
+    }
+  }
+}
+
+class JobObjHandler : public plx::JobObjEventHandler {
+public:
+  std::vector<unsigned int> new_pids;
+  std::vector<unsigned int> dead_pids;
+
+  void AbnormalExit(unsigned int pid, unsigned long error) override {
+    Log::process_exit(pid, error, false);
+    dead_pids.push_back(pid);
+  }
+  void NormalExit(unsigned int pid, unsigned long status) override {
+    Log::process_exit(pid, status, true);
+    dead_pids.push_back(pid);
+  }
+  void NewProcess(unsigned int pid) override {
+    Log::process_new(pid);
+    new_pids.push_back(pid);
+  }
+  void ActiveCountZero() override {
+  }
+  void ActiveProcessLimit() override {
+  }
+  void MemoryLimit(unsigned int pid) {
+  }
+  void TimeLimit(unsigned int pid) {
+  }
+};
+
+void JobThread(plx::CompletionPort* cp) {
+  JobObjHandler job_handler;
+  plx::JobObjecNotification runner(cp, &job_handler);
+
+  plx::JobObject job = plx::JobObject::Create(
+      job_obj_name, plx::JobObjectLimits(),&runner);
+
+  while (true) {
+    auto rv = runner.wait_for_event(INFINITE);
+    if (rv == plx::CompletionPort::op_exit)
+      break;
+  }
+}
+
+// What this process holds under names the new version opens as well: the
+// op log with its flight recorder, and the job object watched by JobThread.
+// An upgrade lets go of them before launching the new version and takes
+// them back if the new version does not come up.
+class Holdings {
+  plx::CompletionPort job_cp_;
+  std::thread job_thread_;
+  LogSync sync_;
+  bool log_;
+  bool jobs_;
+
+public:
+  Holdings() : job_cp_(1), log_(false), jobs_(false) {}
+
+  ~Holdings() {
+    let_go();
+  }
+
+  void open_log() {
+    Log::init(op_log_name);
+    log_ = true;
+  }
+
+  void set_sync(const LogSync& sync) {
+    sync_ = sync;
+    Log::set_sync(sync_);
+  }
+
+  void start_jobs() {
+    job_thread_ = std::thread(JobThread, &job_cp_);
+    jobs_ = true;
+  }
+
+  void let_go() {
+    if (job_thread_.joinable()) {
+      job_cp_.release_waiter();
+      job_thread_.join();
+    }
+    // Gets the records out of the rings and to disk.
+    Log::close();
+  }
+
+  void take_back() {
+    if (log_) {
+      Log::init(op_log_name);
+      Log::set_sync(sync_);
+    }
+    if (jobs_ && !job_thread_.joinable())
+      start_jobs();
+  }
+};
+
+void RollbackInstall(const plx::FilePath& install_dir,
+                     const plx::Version& version,
+                     plx::Process* process,
+                     Holdings* holdings) {
+  if (process->is_valid() && !process->wait_termination(0))
+    process->kill(1, 5000);
+  // Only once the new version is gone, it might have opened the log.
+  holdings->take_back();
+  RemoveFlatDir(install_dir);
+  Log::rolled_back(version);
+}
+
+// Writes the chunk manifest and then the .what manifest, which also covers
+// the chunks file, for a version directory about to be published.
+// Run as: plexmon --publish=<dir>
+bool PublishVersion(const plx::FilePath& dir) {
+  auto exe_path = PlexmonExe(dir);
+  plx::FilePath chunks_path(std::wstring(exe_path.raw()).append(L".chunks"));
+  if (!WriteChunkManifest(exe_path, chunks_path))
+    return false;
+  return WriteManifest(dir);
+}
+
+plx::Process LaunchPlexmonInstall(const plx::FilePath& path) {
   plx::ProcessParams pp(false, 0);
-  plx::Process process = plx::Process::Create(PlexmonExe(path), L"--install", pp);
-  return process.is_valid();
+  return plx::Process::Create(PlexmonExe(path), L"--install", pp);
 }
 
 void IOCPRunner(plx::CompletionPort* cp, unsigned int timeout) {
@@ -138,6 +356,10 @@ class NewVersionHandshake : public plx::OverlappedChannelHandler {
   std::thread* th_;
 
   bool success_;
+  // plx::Clock ticks when the old side started waiting and when it heard
+  // from the new one.
+  unsigned long long started_;
+  unsigned long long finished_;
 
   struct IPC {
     uint8_t buf[8];
@@ -149,9 +371,11 @@ class NewVersionHandshake : public plx::OverlappedChannelHandler {
 
 public:
   NewVersionHandshake() 
-    : srv_pipe_(nullptr), cp_(nullptr), th_(nullptr), success_(false) {}
+    : srv_pipe_(nullptr), cp_(nullptr), th_(nullptr), success_(false),
+      started_(0), finished_(0) {}
 
   bool begin_old() {
+    started_ = plx::Clock::Get().ticks();
     cp_ = new plx::CompletionPort(2);
     srv_pipe_ = new plx::ServerPipe(plx::ServerPipe::Create(
         install_pipe, plx::ServerPipe::overlapped));
@@ -165,9 +389,18 @@ public:
     delete th_;
     delete srv_pipe_;
     delete cp_;
+    if (!finished_)
+      finished_ = plx::Clock::Get().ticks();
     return success_;
   }
 
+  // Separate from end_old() because the log is not open while the new
+  // version is being launched.
+  void log() const {
+    auto& clock = plx::Clock::Get();
+    Log::handshake(success_, clock.to_ns(finished_ - started_));
+  }
+
   void cancel_old() {
     srv_pipe_->disconnect();
     cp_->release_waiter();
@@ -197,6 +430,7 @@ public:
   void OnRead(plx::OverlappedContext* ovc, unsigned long error) override {
     if (error)
       return;
+    finished_ = plx::Clock::Get().ticks();
     auto ipc = reinterpret_cast<IPC*>(ovc->ctx);
     success_ = ipc->chk();
     delete ipc;
@@ -218,50 +452,76 @@ plx::Version GetSelfVersion() {
     plx::Version::FromRange(plx::RangeFromString(str_ver));
 }
 
-bool TryUpgrade(Settings* settings) {
+plx::FilePath DropboxPlexmonPath(const Settings& settings) {
+  return settings.dropbox_root.append(L"vortex\\plexmon");
+}
+
+bool TryUpgrade(Settings* settings, VersionIndex* index, Holdings* holdings) {
   auto our_version = GetSelfVersion();
 
   plx::Version newest_version;
-  auto db_plxmon_path = plx::FilePath(
-      settings->dropbox_root).append(L"vortex\\plexmon");
-  if (!FindHighestVersion(db_plxmon_path, &newest_version))
+  if (!index->refresh())
+    return false;
+  if (!index->highest(&newest_version))
     return false;
 
   if (plx::Version::Compare(newest_version, our_version) <= 0)
     return false;
 
+  // The periodic check should not retry a version that already failed.
+  static plx::Version last_attempt;
+  if (plx::Version::Compare(newest_version, last_attempt) == 0)
+    return false;
+  last_attempt = newest_version;
+
+  auto db_plxmon_path = DropboxPlexmonPath(*settings);
+
   Log::newer_found(newest_version);
 
   auto new_leaf = WideFromString(newest_version.to_string());
   plx::FilePath new_db_dir(db_plxmon_path.append(new_leaf));
 
-  if (!ValidPlexmonDir(new_db_dir))
+  Manifest manifest;
+  if (!ValidPlexmonDir(new_db_dir, &manifest))
     return false;
 
+  // Everything is built next to the final directory and renamed into place
+  // once complete, so a half copied install is never launched.
   auto install_dir = plx::GetExePath().parent().append(new_leaf);
-  if (!::CreateDirectoryW(install_dir.raw(), NULL)) {
-    if (::GetLastError() != ERROR_ALREADY_EXISTS) {
-      Log::soft_fail(SoftFailure::create_failed, __LINE__);
-      return false;
-    }
+  plx::FilePath staging_dir(std::wstring(install_dir.raw()).append(L".staging"));
+  RemoveFlatDir(staging_dir);
+  if (!StageInstall(new_db_dir, staging_dir, manifest)) {
+    RemoveFlatDir(staging_dir);
+    return false;
   }
 
-  if (!::CopyFileW(PlexmonExe(new_db_dir).raw(),
-                   PlexmonExe(install_dir).raw(), TRUE)) {
-    Log::soft_fail(SoftFailure::copy_failed, __LINE__);
+  // Leftovers of an earlier attempt at this version make way.
+  RemoveFlatDir(install_dir);
+  if (!::MoveFileExW(staging_dir.raw(), install_dir.raw(), MOVEFILE_WRITE_THROUGH)) {
+    Log::soft_fail(SoftFailure::create_failed, __LINE__);
+    RemoveFlatDir(staging_dir);
     return false;
   }
+  PrefetchInstall(install_dir, manifest);
 
   NewVersionHandshake handshake;
   handshake.begin_old();
- 
-  if (!LaunchPlexmonInstall(install_dir)) {
+
+  // The new version opens the log, the flight recorder and the job object
+  // by the same names, so they are let go before it starts.
+  holdings->let_go();
+  auto process = LaunchPlexmonInstall(install_dir);
+  if (!process.is_valid()) {
     handshake.cancel_old();
+    RollbackInstall(install_dir, newest_version, &process, holdings);
+    handshake.log();
     Log::soft_fail(SoftFailure::launch_failed, __LINE__);
     return false;
   }
 
   if (!handshake.end_old()) {
+    RollbackInstall(install_dir, newest_version, &process, holdings);
+    handshake.log();
     Log::soft_fail(SoftFailure::timed_out, __LINE__);
     return false;
   }
@@ -269,11 +529,12 @@ bool TryUpgrade(Settings* settings) {
 }
 
 bool InstallSelf() {
-  Log::init(L"vortex\\plexmon\\install_log.txt");
+  Log::init(L"vortex\\plexmon\\install_log.pxl");
   Log::installing(GetSelfVersion());
 
   try {
     auto settings = LoadSettings();
+    Log::set_sync(settings.log_sync);
     MigrateSettings(&settings);
   }
   catch (plx::Exception& ex) {
@@ -289,17 +550,42 @@ bool InstallSelf() {
 }
 
 class TopWindow : public plx::Window <TopWindow> {
+  Settings* settings_;
+  VersionIndex* version_index_;
+  Holdings* holdings_;
+
+  static const UINT_PTR upgrade_timer = 1;
+  static const UINT upgrade_check_ms = 60 * 1000;
+
 public:
-  TopWindow() {
+  TopWindow(Settings* settings, VersionIndex* version_index, Holdings* holdings)
+      : settings_(settings), version_index_(version_index), holdings_(holdings) {
     create_window(0, WS_POPUP, L"plxmon @ 2015",
       nullptr, nullptr,
       10, 10, 0, 0,
       nullptr, nullptr);
+    ::SetTimer(window(), upgrade_timer, upgrade_check_ms, nullptr);
   }
 
   LRESULT message_handler(const UINT message, WPARAM wparam, LPARAM lparam) {
     switch (message) {
+      case WM_TIMER: {
+        // The version index makes this cheap when nothing changed.
+        if (wparam == upgrade_timer) {
+          // Exceptions must not unwind through the window procedure. A
+          // failed check is logged and the next tick tries again.
+          try {
+            if (TryUpgrade(settings_, version_index_, holdings_))
+              ::DestroyWindow(window());
+          } catch (plx::Exception& ex) {
+            Log::soft_fail(SoftFailure::pxl_exception, ex.Line());
+          }
+          return 0;
+        }
+        break;
+      }
       case WM_DESTROY: {
+        ::KillTimer(window(), upgrade_timer);
         ::PostQuitMessage(0);
         return 0;
       }
@@ -308,77 +594,68 @@ public:
   }
 };
 
-class JobObjHandler : public plx::JobObjEventHandler {
-public:
-  std::vector<unsigned int> new_pids;
-  std::vector<unsigned int> dead_pids;
-
-  void AbnormalExit(unsigned int pid, unsigned long error) override {
-    dead_pids.push_back(pid);
-  }
-  void NormalExit(unsigned int pid, unsigned long status) override {
-    dead_pids.push_back(pid);
-  }
-  void NewProcess(unsigned int pid) override {
-    new_pids.push_back(pid);
-  }
-  void ActiveCountZero() override {
-  }
-  void ActiveProcessLimit() override {
-  }
-  void MemoryLimit(unsigned int pid) {
-  }
-  void TimeLimit(unsigned int pid) {
-  }
-};
-
-void JobThread(plx::CompletionPort* cp) {
-  JobObjHandler job_handler;
-  plx::JobObjecNotification runner(cp, &job_handler);
-
-  plx::JobObject job = plx::JobObject::Create(
-      job_obj_name, plx::JobObjectLimits(),&runner);
-
-  while (true) {
-    auto rv = runner.wait_for_event(INFINITE);
-    if (rv == plx::CompletionPort::op_exit)
-      break;
-  }
-}
-
 int __stdcall wWinMain(HINSTANCE instance, HINSTANCE, wchar_t* cmdline, int cmd_show) {
   int rv = 0;
+  // Outside the try so the log is still open for the hard failure below.
+  Holdings holdings;
 
   try {
     int argc = 0;
     auto argv = CommandLineToArgvW(cmdline, &argc);
     plx::CmdLine cmd(argc, argv);
 
+    plx::Range<const wchar_t> publish_dir;
+    if (cmd.has_switch(L"publish", &publish_dir)) {
+      plx::FilePath dir(plx::WideStringFromRange(publish_dir));
+      return PublishVersion(dir) ? 0 : 1;
+    }
+
+    plx::Range<const wchar_t> log_path;
+    if (cmd.has_switch(L"decode", &log_path)) {
+      plx::FilePath path(plx::WideStringFromRange(log_path));
+      return DecodeLog(path, cmd.has_switch(L"json")) ? 0 : 1;
+    }
+
+    if (cmd.has_switch(L"query", &log_path)) {
+      plx::FilePath path(plx::WideStringFromRange(log_path));
+      LogQuery query;
+      plx::Range<const wchar_t> value;
+      if (cmd.has_switch(L"from", &value) && !ParseLogTime(value, &query.from))
+        return 1;
+      if (cmd.has_switch(L"to", &value) && !ParseLogTime(value, &query.to))
+        return 1;
+      if (cmd.has_switch(L"event", &value)) {
+        auto event = plx::WideStringFromRange(value);
+        query.event = plx::UTF8FromUTF16(plx::RangeFromString(event));
+      }
+      return QueryLog(path, query, cmd.has_switch(L"json")) ? 0 : 1;
+    }
+
     if (cmd.has_switch(L"install")) {
       if (!InstallSelf()) {
         return 0;
       }
     }
 
-    Log::init(L"vortex\\plexmon\\op_log.txt");
+    holdings.open_log();
 
     auto settings = LoadSettings();
-    if (TryUpgrade(&settings))
+    holdings.set_sync(settings.log_sync);
+    VersionIndex version_index(DropboxPlexmonPath(settings),
+        plx::GetAppDataPath(false).append(L"vortex\\plexmon\\versions.idx"));
+    if (TryUpgrade(&settings, &version_index, &holdings))
       return 0;
 
-    plx::CompletionPort job_cp(1);
-    std::thread job_thread(JobThread, &job_cp);
+    holdings.start_jobs();
 
-    TopWindow top_window;
+    TopWindow top_window(&settings, &version_index, &holdings);
     MSG msg = { 0 };
     while (::GetMessage(&msg, NULL, 0, 0)) {
       ::TranslateMessage(&msg);
       ::DispatchMessage(&msg);
     }
 
-    job_cp.release_waiter();
-    job_thread.join();
-
+    holdings.let_go();
     rv = (int) msg.wParam;
   }
   catch (AppException& ex) {
@@ -388,6 +665,6 @@ int __stdcall wWinMain(HINSTANCE instance, HINSTANCE, wchar_t* cmdline, int cmd_
     HardfailMsgBox(HardFailure::plex_throw, ex.Line());
   } 
 
-  Log::close();
+  holdings.let_go();
   return rv;
 }
@@ -23,12 +23,110 @@ enum class SoftFailure {
 
 const char* ToString(HardFailure f);
 
+enum class LogSyncMode {
+  none,
+  interval,
+  every_n
+};
+
+// When the log is forced to disk. The flusher writes whatever records are
+// pending as one group and a sync covers the whole group, so the cost is
+// per group and not per record.
+struct LogSync {
+  LogSyncMode mode;
+  unsigned int interval_ms;
+  unsigned int records;
+
+  LogSync() : mode(LogSyncMode::none), interval_ms(1000), records(64) {}
+};
+
 class Log {
 public:
   static void init(const wchar_t* name);
   static void close();
+  static void set_sync(const LogSync& sync);
   static void soft_fail(SoftFailure what, int line);
   static void hard_fail(HardFailure what, int line);
   static void installing(const plx::Version& v);
   static void newer_found(const plx::Version& v);
+  static void delta_built(long long reused, long long fetched);
+  static void rolled_back(const plx::Version& v);
+  static void handshake(bool ok, long long ns);
+  static void process_new(unsigned long pid);
+  static void process_exit(unsigned long pid, unsigned long code, bool normal);
+};
+
+// Writes |path|.txt, or |path|.json with one object per record. Takes live
+// logs, compressed rotated segments and flight recorder files.
+bool DecodeLog(const plx::FilePath& path, bool json);
+
+// Which records QueryLog() keeps. Times are FILETIMEs, both ends included.
+// An empty |event| keeps every event.
+struct LogQuery {
+  long long from;
+  long long to;
+  std::string event;
+
+  LogQuery() : from(0), to(std::numeric_limits<long long>::max()) {}
+};
+
+// Like DecodeLog() but only for the records |query| wants, written to
+// |path|.query.txt or .json. The time index next to a log or an
+// uncompressed segment lets it read just the blocks that can match.
+bool QueryLog(const plx::FilePath& path, const LogQuery& query, bool json);
+// Takes UTC times as yyyy-mm-dd[Thh:mm[:ss[.fffffff]]].
+bool ParseLogTime(const plx::Range<const wchar_t>& text, long long* filetime);
+
+// One file listed in a version's .what manifest.
+struct ManifestEntry {
+  long long size;
+  plx::Sha256::Digest sha256;
+};
+
+typedef std::map<std::wstring, ManifestEntry> Manifest;
+
+bool HashFile(const plx::FilePath& path, ManifestEntry* entry);
+bool ReadManifest(const plx::FilePath& dir, Manifest* manifest);
+// Hashes every listed file in parallel, returns false at the first mismatch.
+bool VerifyManifest(const plx::FilePath& dir, const Manifest& manifest);
+// Lists and hashes every file in |dir| into |dir|\.what.
+bool WriteManifest(const plx::FilePath& dir);
+
+struct DeltaStats {
+  long long reused;
+  long long fetched;
+};
+
+// Publisher side: cuts |file| into content-defined chunks and writes their
+// digests to |chunks_path|.
+bool WriteChunkManifest(const plx::FilePath& file, const plx::FilePath& chunks_path);
+
+// Installer side: rebuilds |remote| into |to| using the chunks of |local|
+// it already has and reading only the rest from |remote|. Fails if there
+// is no chunk manifest next to |remote|.
+bool BuildFromDelta(const plx::FilePath& local, const plx::FilePath& remote,
+                    const plx::FilePath& to, long long expected_size,
+                    const plx::Sha256::Digest& expected, DeltaStats* stats);
+
+// Sorted index of the version directories under the dropbox plexmon folder.
+// It is persisted to |cache_path| and kept current by a directory watcher,
+// so only entries that changed since the last refresh() get parsed.
+class VersionIndex {
+  plx::FilePath dir_path_;
+  plx::FilePath cache_path_;
+  plx::DirChanges changes_;
+  std::vector<plx::Version> versions_;
+  bool dirty_;
+
+public:
+  VersionIndex(const plx::FilePath& dir_path, const plx::FilePath& cache_path);
+  bool refresh();
+  bool highest(plx::Version* ver) const;
+
+private:
+  bool rescan();
+  bool load_cache(long long stamp);
+  void save_cache(long long stamp);
+  void add(const plx::Version& ver);
+  void remove(const plx::Version& ver);
 };
\ No newline at end of file
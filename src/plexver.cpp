@@ -0,0 +1,238 @@
+// plexver.cpp.
+//
+
+#include "stdafx.h"
+#include "plexmon.h"
+
+namespace {
+
+const uint32_t kIndexMagic = 0x69767870;   // 'pxvi'
+const uint32_t kIndexFormat = 1;
+
+struct IndexHeader {
+  uint32_t magic;
+  uint32_t format;
+  uint32_t count;
+  uint32_t reserved;
+  long long stamp;
+};
+
+bool VersionLess(const plx::Version& l, const plx::Version& r) {
+  return plx::Version::Compare(l, r) < 0;
+}
+
+// Parses directory names like "1.2.30.4" in place. Anything that is not
+// dot-separated 16-bit numbers is rejected instead of throwing.
+bool VersionFromName(const plx::ItRange<wchar_t*>& name, plx::Version* ver) {
+  uint32_t v[4] = {};
+  int ix = 0;
+  bool digit = false;
+  for (auto c : name) {
+    if ((c >= L'0') && (c <= L'9')) {
+      v[ix] = (v[ix] * 10) + (c - L'0');
+      if (v[ix] > 0xFFFF)
+        return false;
+      digit = true;
+    } else if ((c == L'.') && digit && (ix < 3)) {
+      digit = false;
+      ++ix;
+    } else {
+      return false;
+    }
+  }
+  if (!digit)
+    return false;
+  *ver = plx::Version(uint16_t(v[0]), uint16_t(v[1]),
+                      uint16_t(v[2]), uint16_t(v[3]));
+  return true;
+}
+
+// The last write time of a directory changes when entries are added,
+// removed or renamed, which is exactly what the cache depends on.
+long long DirStamp(const plx::FilePath& path) {
+  auto par = plx::FileParams::Directory_ShareAll();
+  auto dir = plx::File::Create(path, par, plx::FileSecurity());
+  if (!dir.is_valid())
+    return 0;
+  return dir.last_write_ns1600();
+}
+
+}
+
+VersionIndex::VersionIndex(const plx::FilePath& dir_path,
+                           const plx::FilePath& cache_path)
+    : dir_path_(dir_path), cache_path_(cache_path), dirty_(false) {
+}
+
+bool VersionIndex::refresh() {
+  if (!changes_.is_valid()) {
+    // Watch first, then look at the directory, so no change can fall
+    // in between the two.
+    changes_ = plx::DirChanges::Create(dir_path_, FILE_NOTIFY_CHANGE_DIR_NAME);
+    if (!changes_.is_valid()) {
+      Log::soft_fail(SoftFailure::invalid_dir, __LINE__);
+      return false;
+    }
+    auto stamp = DirStamp(dir_path_);
+    if (load_cache(stamp))
+      return true;
+    if (!rescan())
+      return false;
+  }
+
+  bool overflow;
+  while (changes_.poll(&overflow)) {
+    if (overflow) {
+      if (!rescan())
+        return false;
+    } else {
+      for (changes_.first(); !changes_.done(); changes_.next()) {
+        plx::Version ver;
+        if (!VersionFromName(changes_.file_name(), &ver))
+          continue;
+        if (changes_.action() == plx::DirChanges::added)
+          add(ver);
+        else if (changes_.action() == plx::DirChanges::removed)
+          remove(ver);
+      }
+    }
+    if (!changes_.rearm()) {
+      // The folder went away. Start over on the next refresh.
+      changes_ = plx::DirChanges();
+      versions_.clear();
+      return false;
+    }
+  }
+
+  if (dirty_) {
+    // If something changed after the stamp was taken the cache is written
+    // on a later refresh, with a stamp that accounts for it.
+    auto stamp = DirStamp(dir_path_);
+    if (!changes_.poll(&overflow))
+      save_cache(stamp);
+  }
+  return true;
+}
+
+bool VersionIndex::highest(plx::Version* ver) const {
+  if (versions_.empty())
+    return false;
+  *ver = versions_.back();
+  return true;
+}
+
+bool VersionIndex::rescan() {
+  auto par = plx::FileParams::Directory_ShareAll();
+  plx::File dir = plx::File::Create(dir_path_, par, plx::FileSecurity());
+  if (!dir.is_valid()) {
+    Log::soft_fail(SoftFailure::invalid_dir, __LINE__);
+    return false;
+  }
+
+  versions_.clear();
+  auto finf = plx::FilesInfo::Stream(
+      dir, plx::FilesInfo::dirs_only | plx::FilesInfo::skip_dots);
+  for (finf.first(); !finf.done(); finf.next()) {
+    plx::Version ver;
+    if (VersionFromName(finf.file_name(), &ver))
+      versions_.push_back(ver);
+  }
+
+  std::sort(begin(versions_), end(versions_), VersionLess);
+  dirty_ = true;
+  return true;
+}
+
+bool VersionIndex::load_cache(long long stamp) {
+  if (!stamp)
+    return false;
+  auto op = plx::FileParams::Read_SharedRead();
+  auto file = plx::File::Create(cache_path_, op, plx::FileSecurity());
+  if (!file.is_valid())
+    return false;
+
+  IndexHeader header = {};
+  auto hr = plx::RangeFromBytes(&header, sizeof(header));
+  if (file.read(hr, 0) != sizeof(header))
+    return false;
+  if ((header.magic != kIndexMagic) || (header.format != kIndexFormat))
+    return false;
+  if (header.stamp != stamp)
+    return false;
+
+  // The count must account for exactly the rest of the file, otherwise the
+  // cache is torn or corrupt and the directory is scanned instead.
+  const long long want = sizeof(header) + header.count * 8LL;
+  if (file.size_in_bytes() != want)
+    return false;
+
+  std::vector<uint16_t> raw(size_t(header.count) * 4);
+  if (header.count) {
+    auto rr = plx::RangeFromVector(raw).bytes();
+    if (file.read(rr, sizeof(header)) != rr.size())
+      return false;
+  }
+
+  versions_.clear();
+  versions_.reserve(header.count);
+  for (size_t ix = 0; ix != raw.size(); ix += 4)
+    versions_.emplace_back(raw[ix], raw[ix + 1], raw[ix + 2], raw[ix + 3]);
+  // Strictly increasing, a cache written with a duplicate is rebuilt.
+  if (!std::is_sorted(begin(versions_), end(versions_), VersionLess) ||
+      (std::adjacent_find(begin(versions_), end(versions_),
+          [](const plx::Version& l, const plx::Version& r) {
+            return plx::Version::Compare(l, r) == 0;
+          }) != end(versions_))) {
+    versions_.clear();
+    return false;
+  }
+
+  dirty_ = false;
+  return true;
+}
+
+void VersionIndex::save_cache(long long stamp) {
+  auto op = plx::FileParams::ReadWrite_SharedRead(CREATE_ALWAYS);
+  auto file = plx::File::Create(cache_path_, op, plx::FileSecurity());
+  if (!file.is_valid()) {
+    Log::soft_fail(SoftFailure::create_failed, __LINE__);
+    return;
+  }
+
+  std::vector<uint16_t> raw;
+  raw.reserve(versions_.size() * 4);
+  for (auto& ver : versions_) {
+    raw.push_back(uint16_t(ver.major()));
+    raw.push_back(uint16_t(ver.minor()));
+    raw.push_back(uint16_t(ver.rev()));
+    raw.push_back(uint16_t(ver.build()));
+  }
+
+  IndexHeader header = { kIndexMagic, kIndexFormat,
+                         plx::To<uint32_t>(versions_.size()), 0, stamp };
+  plx::Range<const uint8_t> parts[2] = {
+    plx::RangeFromBytes(&header, sizeof(header))
+  };
+  if (!raw.empty())
+    parts[1] = plx::RangeFromVector(raw).const_bytes();
+  file.writev(plx::RangeFromArray(parts));
+  dirty_ = false;
+}
+
+// A directory made while the watch was being set up is found by the scan
+// and then reported again as added, so adding is a no-op if it is there.
+void VersionIndex::add(const plx::Version& ver) {
+  auto it = std::lower_bound(begin(versions_), end(versions_), ver, VersionLess);
+  if ((it != end(versions_)) && (plx::Version::Compare(*it, ver) == 0))
+    return;
+  versions_.insert(it, ver);
+  dirty_ = true;
+}
+
+void VersionIndex::remove(const plx::Version& ver) {
+  auto range = std::equal_range(begin(versions_), end(versions_), ver, VersionLess);
+  if (range.first == range.second)
+    return;
+  versions_.erase(range.first, range.second);
+  dirty_ = true;
+}
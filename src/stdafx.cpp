@@ -1,11 +1,15 @@
 // This is the plex precompiled header cc.
-// Do not edit this file by hand.
+// Generated by plex.exe from the plex catalog, and since then extended in this
+// tree with code the catalog does not have yet (json parsing, mapped files,
+// formatting). Merge those into the catalog before generating it again, the
+// generator would drop them.
 
 #include "stdafx.h"
 
 
 
 #pragma comment(lib, "shcore.lib")
+#pragma comment(lib, "bcrypt.lib")
 namespace plx {
 ItRange<uint8_t*> RangeFromBytes(void* start, size_t count) {
   auto s = reinterpret_cast<uint8_t*>(start);
@@ -78,6 +82,77 @@ std::string HexASCIIStr(const plx::Range<const uint8_t>& r, char separator) {
   }
   return str;
 }
+bool BytesFromHexASCII(const plx::Range<const char>& hex, plx::Range<uint8_t>& out) {
+  if (hex.size() != (out.size() * 2))
+    return false;
+
+  auto nibble = [](char c) -> int {
+    if ((c >= '0') && (c <= '9'))
+      return c - '0';
+    if ((c >= 'A') && (c <= 'F'))
+      return c - 'A' + 10;
+    if ((c >= 'a') && (c <= 'f'))
+      return c - 'a' + 10;
+    return -1;
+  };
+
+  for (size_t ix = 0; ix != out.size(); ++ix) {
+    auto hi = nibble(hex[ix * 2]);
+    auto lo = nibble(hex[(ix * 2) + 1]);
+    if ((hi < 0) || (lo < 0))
+      return false;
+    out[ix] = static_cast<uint8_t>((hi << 4) | lo);
+  }
+  return true;
+}
+bool CopyFileVerified(const plx::FilePath& from, const plx::FilePath& to,
+                      long long expected_size,
+                      const plx::Sha256::Digest& expected) {
+  auto src = plx::File::Create(
+      from, plx::FileParams::ReadSequential_SharedRead(), plx::FileSecurity());
+  if (!src.is_valid())
+    return false;
+  if (src.size_in_bytes() != expected_size)
+    return false;
+
+  plx::FilePath tmp(std::wstring(to.raw()).append(L".tmp"));
+  bool ok = false;
+  {
+    auto dst = plx::File::Create(
+        tmp, plx::FileParams::Write_Exclusive(CREATE_ALWAYS), plx::FileSecurity());
+    if (!dst.is_valid())
+      return false;
+
+    const size_t buf_size = 1024 * 1024;
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[buf_size]);
+    plx::Sha256 sha;
+    long long total = 0;
+
+    while (true) {
+      auto rd = src.read(buf.get(), buf_size, -1);
+      if (!rd)
+        break;
+      plx::Range<const uint8_t> chunk(buf.get(), rd);
+      sha.update(chunk);
+      if (dst.write(chunk) != rd)
+        break;
+      total += rd;
+      if (total > expected_size)
+        break;
+    }
+
+    ok = (total == expected_size) && (sha.finish() == expected) && dst.flush();
+  }
+
+  if (ok) {
+    ok = ::MoveFileExW(tmp.raw(), to.raw(),
+                       MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ?
+        true : false;
+  }
+  if (!ok)
+    ::DeleteFileW(tmp.raw());
+  return ok;
+}
 short NextInt(char value) {
   return short(value);
 }
@@ -117,30 +192,25 @@ std::string DecodeString(plx::Range<const char>& range) {
     auto r = plx::RangeFromBytes(range.start(), 1);
     throw plx::CodecException(__LINE__, &r);
   }
+  range.advance(1);
 
   std::string s;
   for (;;) {
-    auto text_start = range.start();
-    while (range.advance(1) > 0) {
-      auto c = range.front();
-      if (c < 32) {
-        throw plx::CodecException(__LINE__, nullptr);
-      } else {
-        switch (c) {
-          case '\"' : break;
-          case '\\' : goto escape;
-          default: continue;
-        }
-      }
-      s.append(++text_start, range.start());
+    // Copy the plain bytes up to the next quote, escape or control byte.
+    auto run = plx::JsonScanner::StringRun(range.start(), range.size());
+    s.append(range.start(), run);
+    range.advance(run);
+    // Reached the end of range before a (").
+    if (range.empty())
+      throw plx::CodecException(__LINE__, nullptr);
+
+    auto c = range.front();
+    if (c == '\"') {
       range.advance(1);
       return s;
     }
-    // Reached the end of range before a (").
-    throw plx::CodecException(__LINE__, nullptr);
-
-  escape:
-    s.append(++text_start, range.start());
+    if (c != '\\')
+      throw plx::CodecException(__LINE__, nullptr);
     if (range.advance(1) <= 0)
       throw plx::CodecException(__LINE__, nullptr);
 
@@ -158,141 +228,258 @@ std::string DecodeString(plx::Range<const char>& range) {
         throw plx::CodecException(__LINE__, &r);
       }
     }
+    range.advance(1);
   }
 }
 namespace JsonImp {
-template <typename StrT>
-bool Consume(plx::Range<const char>& r, StrT&& str) {
-  auto c = r.starts_with(plx::RangeFromLitStr(str));
-  if (c) {
-    r.advance(c);
-    return true;
-  }
-  else {
-    return (c != 0);
+// The text and the offsets JsonScanner found in it. |ix| is the next
+// offset to use and |end| is one past the last byte consumed. With |views|
+// the strings that have no escapes point into |text|. The containers and
+// the decoded strings come from |arena| unless it is null. |stack| holds
+// the elements of the arrays being parsed.
+struct Structure {
+  const char* text;
+  size_t size;
+  const std::vector<uint32_t>* offsets;
+  size_t ix;
+  size_t end;
+  bool views;
+  plx::Arena* arena;
+  std::vector<plx::JsonValue> stack;
+};
+
+size_t NextOffset(Structure& st) {
+  if (st.ix == st.offsets->size())
+    throw plx::CodecException(__LINE__, nullptr);
+  size_t at = (*st.offsets)[st.ix++];
+  if (at < st.end)
+    throw plx::CodecException(__LINE__, nullptr);
+  return at;
+}
+
+// Scalars have no closing character, what follows them must be
+// whitespace, punctuation or the end.
+void CheckScalarEnd(const Structure& st) {
+  if (st.end == st.size)
+    return;
+  switch (st.text[st.end]) {
+    case ' ': case '\t': case '\n': case '\r':
+    case ',': case ':': case ']': case '}': case '[': case '{': case '\"':
+      return;
   }
+  auto r = plx::RangeFromBytes(st.text + st.end, 1);
+  throw plx::CodecException(__LINE__, &r);
 }
 
-bool IsNumber(plx::Range<const char>&r) {
-  if ((r.front() >= '0') && (r.front() <= '9'))
-    return true;
-  if ((r.front() == '-') || (r.front() == '+'))
-    return true;
-  if (r.front() == '.')
+bool IsNumber(char c) {
+  if ((c >= '0') && (c <= '9'))
     return true;
-  return false;
+  return (c == '-') || (c == '+') || (c == '.');
 }
 
-plx::JsonValue ParseArray(plx::Range<const char>& range) {
-  if (range.empty())
-    throw plx::CodecException(__LINE__, NULL);
-  if (range.front() != '[')
-    throw plx::CodecException(__LINE__, NULL);
-
-  JsonValue value(plx::JsonType::ARRAY);
-  range.advance(1);
-
-  for (;!range.empty();) {
-    range = plx::SkipWhitespace(range);
-
-    if (range.front() == ',') {
-      if (range.advance(1) <= 0)
-        break;
-      range = plx::SkipWhitespace(range);
-    }
-
-    if (range.front() == ']') {
-      range.advance(1);
-      return value;
-    }
-
-    value.push_back(ParseJsonValue(range));
+bool IsNumberChar(char c) {
+  if ((c >= '0') && (c <= '9'))
+    return true;
+  switch (c) {
+    case '-': case '+': case '.': case 'e': case 'E':
+      return true;
+    default:
+      return false;
   }
-
-  auto r = plx::RangeFromBytes(range.start(), range.size());
-  throw plx::CodecException(__LINE__, &r);
 }
 
 plx::JsonValue ParseNumber(plx::Range<const char>& range) {
-  size_t pos = 0;
-  auto num = plx::StringFromRange(range);
-
-  auto iv = std::stoll(num, &pos);
-  if ((range[pos] != 'e') && (range[pos] != 'E') && (range[pos] != '.')) {
+  // Only the number is copied, the parsing never looks past the range.
+  size_t len = 0;
+  while ((len != range.size()) && IsNumberChar(range[len]))
+    ++len;
+  std::string num(range.start(), len);
+
+  // Integers too big for 64 bits become doubles, doubles too big for that
+  // and text that is not a number are an error, as in JsonReader.
+  char* stop = nullptr;
+  errno = 0;
+  auto iv = ::strtoll(num.c_str(), &stop, 10);
+  size_t pos = stop - num.c_str();
+  if (pos && (errno != ERANGE) &&
+      ((pos == len) || ((num[pos] != 'e') && (num[pos] != 'E') && (num[pos] != '.')))) {
     range.advance(pos);
     return iv;
   }
 
-  auto dv = std::stod(num, &pos);
+  errno = 0;
+  auto dv = ::strtod(num.c_str(), &stop);
+  pos = stop - num.c_str();
+  if (!pos || ((errno == ERANGE) && ((dv > 1.0) || (dv < -1.0)))) {
+    auto r = plx::RangeFromBytes(range.start(), len);
+    throw plx::CodecException(__LINE__, &r);
+  }
   range.advance(pos);
   return dv;
 }
 
-plx::JsonValue ParseObject(plx::Range<const char>& range) {
-  if (range.empty())
-    throw plx::CodecException(__LINE__, NULL);
-  if (range.front() != '{')
-    throw plx::CodecException(__LINE__, NULL);
+plx::JsonString ParseString(Structure& st, size_t at) {
+  if (st.views) {
+    auto start = st.text + at + 1;
+    auto run = plx::JsonScanner::StringRun(start, st.size - at - 1);
+    if ((at + 1 + run != st.size) && (start[run] == '\"')) {
+      st.end = at + run + 2;
+      return plx::JsonString::View(start, run);
+    }
+  }
+  plx::Range<const char> r(st.text + at, st.text + st.size);
+  auto s = plx::DecodeString(r);
+  st.end = r.start() - st.text;
+  if (!st.arena || s.empty())
+    return plx::JsonString(std::move(s));
+  auto copy = static_cast<char*>(st.arena->allocate(s.size(), 1));
+  memcpy(copy, s.data(), s.size());
+  return plx::JsonString::View(copy, s.size());
+}
 
-  JsonValue obj(plx::JsonType::OBJECT);
-  range.advance(1);
+template <typename StrT>
+bool ParseLiteral(Structure& st, size_t at, StrT&& str) {
+  auto lit = plx::RangeFromLitStr(str);
+  plx::Range<const char> r(st.text + at, st.text + st.size);
+  if (r.starts_with(lit) != lit.size())
+    return false;
+  st.end = at + lit.size();
+  CheckScalarEnd(st);
+  return true;
+}
 
-  for (;!range.empty();) {
-    if (range.front() == '}') {
-      range.advance(1);
-      return obj;
-    }
+plx::JsonValue ParseValue(Structure& st);
 
-    range = plx::SkipWhitespace(range);
-    auto key = plx::DecodeString(range);
+// The elements of an array wait on the stack so that the array is
+// allocated once, at its final size.
+plx::JsonValue FinishArray(Structure& st, size_t base) {
+  auto first = begin(st.stack) + base;
+  JsonValue value(std::make_move_iterator(first),
+                  std::make_move_iterator(end(st.stack)), st.arena);
+  st.stack.erase(first, end(st.stack));
+  return value;
+}
 
-    range = plx::SkipWhitespace(range);
-    if (range.front() != ':')
+plx::JsonValue ParseArray(Structure& st) {
+  auto base = st.stack.size();
+  for (;;) {
+    auto ix = st.ix;
+    auto at = NextOffset(st);
+    // Empty arrays and a trailing comma end here.
+    if (st.text[at] == ']') {
+      st.end = at + 1;
+      return FinishArray(st, base);
+    }
+    st.ix = ix;
+    st.stack.push_back(ParseValue(st));
+
+    at = NextOffset(st);
+    st.end = at + 1;
+    if (st.text[at] == ']')
+      return FinishArray(st, base);
+    if (st.text[at] != ',') {
+      auto r = plx::RangeFromBytes(st.text + at, st.size - at);
+      throw plx::CodecException(__LINE__, &r);
+    }
+  }
+}
+
+plx::JsonValue ParseObject(Structure& st) {
+  JsonValue obj(plx::JsonType::OBJECT, st.arena);
+  for (;;) {
+    auto at = NextOffset(st);
+    // Empty objects and a trailing comma end here.
+    if (st.text[at] == '}') {
+      st.end = at + 1;
+      return obj;
+    }
+    if (st.text[at] != '\"')
       throw plx::CodecException(__LINE__, nullptr);
-    if (range.advance(1) <= 0)
+    auto key = ParseString(st, at);
+
+    at = NextOffset(st);
+    if (st.text[at] != ':')
       throw plx::CodecException(__LINE__, nullptr);
+    st.end = at + 1;
+    obj[std::move(key)] = ParseValue(st);
 
-    range = plx::SkipWhitespace(range);
-    obj[key] = ParseJsonValue(range);
+    at = NextOffset(st);
+    st.end = at + 1;
+    if (st.text[at] == '}')
+      return obj;
+    if (st.text[at] != ',')
+      throw plx::CodecException(__LINE__, nullptr);
+  }
+}
 
-    range = plx::SkipWhitespace(range);
-    if (range.front() == ',') {
-      if (range.advance(1) <= 0)
-        break;
-      range = plx::SkipWhitespace(range);
-    }
+plx::JsonValue ParseValue(Structure& st) {
+  auto at = NextOffset(st);
+  switch (st.text[at]) {
+    case '{':
+      st.end = at + 1;
+      return ParseObject(st);
+    case '[':
+      st.end = at + 1;
+      return ParseArray(st);
+    case '\"':
+      return ParseString(st, at);
+    case 't':
+      if (ParseLiteral(st, at, "true"))
+        return true;
+      break;
+    case 'f':
+      if (ParseLiteral(st, at, "false"))
+        return false;
+      break;
+    case 'n':
+      if (ParseLiteral(st, at, "null"))
+        return nullptr;
+      break;
+    default:
+      if (IsNumber(st.text[at])) {
+        plx::Range<const char> r(st.text + at, st.text + st.size);
+        auto num = ParseNumber(r);
+        st.end = r.start() - st.text;
+        CheckScalarEnd(st);
+        return num;
+      }
   }
-  throw plx::CodecException(__LINE__, nullptr);
+  auto r = plx::RangeFromBytes(st.text + at, st.size - at);
+  throw plx::CodecException(__LINE__, &r);
 }
 
+plx::JsonValue Parse(plx::Range<const char>& range, bool views, plx::Arena* arena) {
+  // Stage one finds where every token starts, stage two builds the values
+  // without looking at the bytes in between.
+  std::vector<uint32_t> offsets;
+  plx::JsonScanner scanner;
+  scanner.scan_all(range.start(), range.size(), &offsets);
+  Structure st = { range.start(), range.size(), &offsets, 0, 0, views, arena };
+  auto value = ParseValue(st);
+  range.advance(st.end);
+  return value;
 }
-plx::JsonValue ParseJsonValue(plx::Range<const char>& range) {
-  range = plx::SkipWhitespace(range);
-  if (range.empty())
-    throw plx::CodecException(__LINE__, NULL);
-
-  if (range.front() == '{')
-    return JsonImp::ParseObject(range);
-  if (range.front() == '\"')
-    return plx::DecodeString(range);
-  if (range.front() == '[')
-    return JsonImp::ParseArray(range);
-  if (JsonImp::Consume(range, "true"))
-    return true;
-  if (JsonImp::Consume(range, "false"))
-    return false;
-  if (JsonImp::Consume(range, "null"))
-    return nullptr;
-  if (JsonImp::IsNumber(range))
-    return JsonImp::ParseNumber(range);
 
-  auto r = plx::RangeFromBytes(range.start(), range.size());
-  throw plx::CodecException(__LINE__, &r);
+}
+plx::JsonValue ParseJsonValue(plx::Range<const char>& range) {
+  return JsonImp::Parse(range, false, nullptr);
+}
+plx::JsonValue ParseJsonView(plx::Range<const char>& range, plx::Arena* arena) {
+  return JsonImp::Parse(range, true, arena);
 }
 plx::JsonValue JsonFromFile(plx::File& cfile) {
   if (!cfile.is_valid())
     throw plx::IOException(__LINE__, L"<json file>");
   auto size = cfile.size_in_bytes();
+  // Big files are parsed in place from a mapped view, small ones are
+  // cheaper to read than to map.
+  if (size >= 64 * 1024) {
+    auto mapped = plx::MappedFile::Create(cfile);
+    auto view = mapped.view();
+    plx::Range<const char> json(reinterpret_cast<const char*>(view.start()),
+                                reinterpret_cast<const char*>(view.end()));
+    return plx::ParseJsonValue(json);
+  }
   plx::Range<uint8_t> r(0, plx::To<size_t>(size));
   auto mem = plx::HeapRange(r);
   if (cfile.read(r, 0) != size)
@@ -303,22 +490,30 @@ plx::JsonValue JsonFromFile(plx::File& cfile) {
 }
 int vsnprintf(char* buffer, size_t size,
               const char* format, va_list arguments) {
+  // The first call consumes its va_list, the count needs its own copy.
+  va_list again;
+  va_copy(again, arguments);
   int length = _vsprintf_p(buffer, size, format, arguments);
   if (length < 0) {
     if (size > 0)
       buffer[0] = 0;
-    return _vscprintf_p(format, arguments);
+    length = _vscprintf_p(format, again);
   }
+  va_end(again);
   return length;
 }
 int vsnprintf(wchar_t* buffer, size_t size,
               const wchar_t* format, va_list arguments) {
+  // The first call consumes its va_list, the count needs its own copy.
+  va_list again;
+  va_copy(again, arguments);
   int length = _vswprintf_p(buffer, size, format, arguments);
   if (length < 0) {
     if (size > 0)
       buffer[0] = 0;
-    return _vscwprintf_p(format, arguments);
+    length = _vscwprintf_p(format, again);
   }
+  va_end(again);
   return length;
 }
 std::wstring UTF16FromUTF8(const plx::Range<const uint8_t>& utf8, bool strict) {
@@ -1,4 +1,5 @@
 // This is the plex precompiled header, not the same as the VC precompiled header.
+// Like stdafx.cpp it carries code the plex catalog does not have yet.
 
 #pragma once
 #define NOMINMAX
@@ -12,13 +13,16 @@
 #include <shellscalingapi.h>
 #include <shlobj.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <string.h>
 #include <array>
+#include <atomic>
 #include <initializer_list>
 #include <cctype>
 #include <iterator>
 #include <list>
 #include <map>
+#include <mutex>
 #include <algorithm>
 #include <utility>
 #include <limits>
@@ -32,6 +36,9 @@
 
 const int plex_vista_support = 1;
 #include <windows.h>
+#include <bcrypt.h>
+#include <compressapi.h>
+#include <intrin.h>
 
 
 
@@ -567,67 +574,378 @@ public:
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// plx::LinkedBuffers
+// plx::LinkedBuffers (a sequence of buffers carved from a growing arena)
+// chunks_ : the arena, each chunk is twice the previous up to |kMaxChunk|.
+// buffers_ : the handed out buffers in order, all inside |chunks_|.
+// current_ : the chunk being carved, |used_| bytes of it are taken.
+// loop_ix_ : the iteration position in |buffers_|.
 //
 class LinkedBuffers {
-  struct Item {
+  struct Chunk {
     size_t size;
     std::unique_ptr<uint8_t[]> data;
-    Item(size_t size)
-        : size(size), data(new uint8_t[size]) {
-    }
-
-    Item(const Item& other)
-        : size(other.size), data(new uint8_t[size]) {
-      memcpy(data.get(), other.data.get(), size);
-    }
-
-    Item(Item&& other) = delete;
   };
 
-  typedef std::list<Item> BList;
+  static const size_t kFirstChunk = 64 * 1024;
+  static const size_t kMaxChunk = 8 * 1024 * 1024;
 
-  BList buffers_;
-  BList::iterator loop_it_;
+  std::vector<Chunk> chunks_;
+  std::vector<plx::Range<uint8_t>> buffers_;
+  size_t current_;
+  size_t used_;
+  size_t loop_ix_;
 
 public:
-  LinkedBuffers() {
+  LinkedBuffers() : current_(0), used_(0), loop_ix_(0) {
   }
 
   LinkedBuffers(const LinkedBuffers& other)
-      : buffers_(other.buffers_) {
+      : current_(0), used_(0), loop_ix_(0) {
+    for (auto& b : other.buffers_) {
+      auto nb = new_buffer(b.size());
+      memcpy(nb.start(), b.start(), b.size());
+    }
   }
 
-  LinkedBuffers(LinkedBuffers&& other) {
+  LinkedBuffers(LinkedBuffers&& other)
+      : current_(0), used_(0), loop_ix_(0) {
+    chunks_.swap(other.chunks_);
     buffers_.swap(other.buffers_);
-    std::swap(loop_it_, other.loop_it_);
+    std::swap(current_, other.current_);
+    std::swap(used_, other.used_);
+    std::swap(loop_ix_, other.loop_ix_);
   }
 
+  // The buffer is 8-byte aligned and stays valid until reset().
   plx::Range<uint8_t> new_buffer(size_t size_bytes) {
-    buffers_.emplace_back(size_bytes);
-    auto start = &(buffers_.back().data)[0];
-    return plx::Range<uint8_t>(start, start + size_bytes);
+    used_ = (used_ + 7) & ~size_t(7);
+    while ((current_ < chunks_.size()) &&
+           ((chunks_[current_].size < used_) ||
+            (chunks_[current_].size - used_ < size_bytes))) {
+      ++current_;
+      used_ = 0;
+    }
+    if (current_ == chunks_.size()) {
+      auto grow = chunks_.empty() ?
+          kFirstChunk : std::min(chunks_.back().size * 2, kMaxChunk);
+      Chunk chunk = { std::max(grow, size_bytes), nullptr };
+      chunk.data.reset(new uint8_t[chunk.size]);
+      chunks_.push_back(std::move(chunk));
+      used_ = 0;
+    }
+    auto start = chunks_[current_].data.get() + used_;
+    used_ += size_bytes;
+    buffers_.emplace_back(start, size_bytes);
+    return buffers_.back();
+  }
+
+  // Gives back the unused tail of the last buffer to the arena.
+  void shrink_last_buffer(size_t size_bytes) {
+    auto& last = buffers_.back();
+    if (size_bytes > last.size())
+      throw plx::RangeException(__LINE__, nullptr);
+    used_ -= (last.size() - size_bytes);
+    last = plx::Range<uint8_t>(last.start(), size_bytes);
   }
 
   void remove_last_buffer() {
+    shrink_last_buffer(0);
     buffers_.pop_back();
   }
 
+  // Forgets all the buffers but keeps the memory for the next round.
+  void reset() {
+    buffers_.clear();
+    current_ = 0;
+    used_ = 0;
+    loop_ix_ = 0;
+  }
+
   void first() {
-    loop_it_ = begin(buffers_);
+    loop_ix_ = 0;
   }
 
   void next() {
-    ++loop_it_;
+    ++loop_ix_;
   }
 
   bool done() {
-    return (loop_it_ == end(buffers_));
+    return (loop_ix_ >= buffers_.size());
   }
 
   plx::Range<uint8_t> get() {
-    auto start = &(loop_it_->data)[0];
-    return plx::Range<uint8_t>(start, start + loop_it_->size);
+    return buffers_[loop_ix_];
+  }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::Arena (bump allocator, all the memory is freed at once)
+// chunks_ : the memory, each chunk is twice the previous up to |kMaxChunk|.
+// next_ : the first free byte of the last chunk.
+// left_ : the free bytes at |next_|.
+// grow_ : the size of the next chunk.
+//
+class Arena {
+  static const size_t kMinChunk = 4 * 1024;
+  static const size_t kMaxChunk = 1024 * 1024;
+
+  std::vector<std::unique_ptr<uint8_t[]>> chunks_;
+  uint8_t* next_;
+  size_t left_;
+  size_t grow_;
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+public:
+  // |first_chunk| is kept between kMinChunk and kMaxChunk.
+  explicit Arena(size_t first_chunk = kMinChunk)
+      : next_(nullptr), left_(0),
+        grow_(std::min(std::max(first_chunk, size_t(kMinChunk)), size_t(kMaxChunk))) {
+  }
+
+  void* allocate(size_t size, size_t align) {
+    auto pad = (0 - reinterpret_cast<uintptr_t>(next_)) & (align - 1);
+    if ((pad > left_) || (size > left_ - pad)) {
+      new_chunk(size + align);
+      pad = (0 - reinterpret_cast<uintptr_t>(next_)) & (align - 1);
+    }
+    auto p = next_ + pad;
+    next_ = p + size;
+    left_ -= pad + size;
+    return p;
+  }
+
+private:
+  void new_chunk(size_t min_size) {
+    auto size = std::max(grow_, min_size);
+    chunks_.emplace_back(new uint8_t[size]);
+    next_ = chunks_.back().get();
+    left_ = size;
+    grow_ = std::min(grow_ * 2, size_t(kMaxChunk));
+  }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::ArenaAllocator (std allocator on top of an Arena)
+// arena_ : where the memory comes from, the heap when null. Deallocation
+//   does nothing for the arena. Containers copied from one that uses an
+//   arena go back to the heap.
+//
+template <typename T>
+class ArenaAllocator {
+  template <typename U> friend class ArenaAllocator;
+  plx::Arena* arena_;
+
+public:
+  typedef T value_type;
+
+  template <typename U>
+  struct rebind {
+    typedef ArenaAllocator<U> other;
+  };
+
+  ArenaAllocator() : arena_(nullptr) {
+  }
+
+  explicit ArenaAllocator(plx::Arena* arena) : arena_(arena) {
+  }
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena_(other.arena_) {
+  }
+
+  T* allocate(size_t count) {
+    if (count > (std::numeric_limits<size_t>::max() / sizeof(T)))
+      throw std::bad_alloc();
+    if (!arena_)
+      return static_cast<T*>(::operator new(count * sizeof(T)));
+    return static_cast<T*>(arena_->allocate(count * sizeof(T), __alignof(T)));
+  }
+
+  void deallocate(T* p, size_t) {
+    if (!arena_)
+      ::operator delete(p);
+  }
+
+  ArenaAllocator select_on_container_copy_construction() const {
+    return ArenaAllocator();
+  }
+
+  plx::Arena* arena() const {
+    return arena_;
+  }
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U>& other) const {
+    return arena_ == other.arena_;
+  }
+
+  template <typename U>
+  bool operator!=(const ArenaAllocator<U>& other) const {
+    return arena_ != other.arena_;
+  }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::SpscRing (lock-free queue for one producer and one consumer thread)
+// head_ : slots written, only the producer stores it.
+// tail_ : slots consumed, only the consumer stores it.
+// Slots are filled and read in place, reserve() + commit() on one side and
+// peek() + pop() on the other.
+//
+template <typename T, size_t count>
+class SpscRing {
+  static_assert((count & (count - 1)) == 0, "count must be a power of two");
+
+  std::atomic<size_t> head_;
+  char pad0_[64 - sizeof(size_t)];
+  std::atomic<size_t> tail_;
+  char pad1_[64 - sizeof(size_t)];
+  T slots_[count];
+
+  SpscRing(const SpscRing&) = delete;
+  SpscRing& operator=(const SpscRing&) = delete;
+
+public:
+  SpscRing() : head_(0), tail_(0) {
+  }
+
+  // Producer side. Returns null when full.
+  T* reserve() {
+    auto head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == count)
+      return nullptr;
+    return &slots_[head & (count - 1)];
+  }
+
+  void commit() {
+    head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Either side, a snapshot.
+  size_t size() const {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+  }
+
+  // Consumer side. |ix| counts from the oldest slot, null past the end.
+  T* peek(size_t ix) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    if (head_.load(std::memory_order_acquire) - tail <= ix)
+      return nullptr;
+    return &slots_[(tail + ix) & (count - 1)];
+  }
+
+  void pop(size_t n) {
+    tail_.store(tail_.load(std::memory_order_relaxed) + n, std::memory_order_release);
+  }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::Clock (monotonic high resolution timestamps)
+// tsc_ : true when the invariant TSC is read directly, else QPC is used.
+// freq_ : ticks per second, measured against QPC for the TSC.
+// Raw ticks are the cheap thing to store, convert them to ns when needed.
+//
+class Clock {
+  bool tsc_;
+  unsigned long long freq_;
+
+  Clock() : tsc_(HasInvariantTsc()), freq_(QpcFrequency()) {
+    if (!tsc_)
+      return;
+    auto q0 = Qpc();
+    auto t0 = __rdtsc();
+    ::Sleep(10);
+    auto q1 = Qpc();
+    auto t1 = __rdtsc();
+    if ((q1 <= q0) || (t1 <= t0)) {
+      tsc_ = false;
+      return;
+    }
+    freq_ = ((t1 - t0) * freq_) / (q1 - q0);
+  }
+
+  static bool HasInvariantTsc() {
+    int regs[4];
+    __cpuid(regs, 0x80000000);
+    if (static_cast<unsigned int>(regs[0]) < 0x80000007)
+      return false;
+    __cpuid(regs, 0x80000007);
+    return (regs[3] & (1 << 8)) != 0;
+  }
+
+  static unsigned long long Qpc() {
+    LARGE_INTEGER li;
+    ::QueryPerformanceCounter(&li);
+    return li.QuadPart;
+  }
+
+  static unsigned long long QpcFrequency() {
+    LARGE_INTEGER li;
+    ::QueryPerformanceFrequency(&li);
+    return li.QuadPart;
+  }
+
+public:
+  // A wall time, as a FILETIME, and the ticks of the same moment.
+  struct Anchor {
+    unsigned long long ticks;
+    long long wall;
+  };
+
+  // Calibrated once, the first call takes about 10 ms.
+  static const Clock& Get() {
+    static Clock clock;
+    return clock;
+  }
+
+  unsigned long long ticks() const {
+    return tsc_ ? __rdtsc() : Qpc();
+  }
+
+  unsigned long long frequency() const {
+    return freq_;
+  }
+
+  bool is_tsc() const {
+    return tsc_;
+  }
+
+  // Split the division so the multiplication can't overflow.
+  long long to_ns(unsigned long long ticks) const {
+    return static_cast<long long>(((ticks / freq_) * 1000000000ULL) +
+                                  (((ticks % freq_) * 1000000000ULL) / freq_));
+  }
+
+  long long now_ns() const {
+    return to_ns(ticks());
+  }
+
+  long long elapsed_ns(unsigned long long from) const {
+    return to_ns(ticks() - from);
+  }
+
+  // The precise wall clock needs Windows 8, older systems get the one that
+  // moves with the timer tick.
+  Anchor anchor() const {
+    typedef VOID (WINAPI* SystemTimeFn)(LPFILETIME);
+    static auto fn = reinterpret_cast<SystemTimeFn>(::GetProcAddress(
+        ::GetModuleHandleW(L"kernel32.dll"), "GetSystemTimePreciseAsFileTime"));
+    FILETIME ft;
+    Anchor an;
+    an.ticks = ticks();
+    if (fn)
+      fn(&ft);
+    else
+      ::GetSystemTimeAsFileTime(&ft);
+    ULARGE_INTEGER ul = { ft.dwLowDateTime, ft.dwHighDateTime };
+    an.wall = static_cast<long long>(ul.QuadPart);
+    return an;
   }
 };
 
@@ -665,6 +983,231 @@ char* HexASCII(uint8_t byte, char* out) ;
 std::string HexASCIIStr(const plx::Range<const uint8_t>& r, char separator) ;
 
 
+///////////////////////////////////////////////////////////////////////////////
+// plx::BytesFromHexASCII (the inverse of HexASCIIStr without separators)
+// returns false if |hex| is not exactly 2 * |out| hex digits.
+//
+bool BytesFromHexASCII(const plx::Range<const char>& hex, plx::Range<uint8_t>& out) ;
+
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::Sha256 (incremental SHA-256 using CNG)
+// hash_ : the running hash. The algorithm provider is shared and never freed.
+//
+class Sha256 {
+  BCRYPT_HASH_HANDLE hash_;
+
+  Sha256(const Sha256&) = delete;
+  Sha256& operator=(const Sha256&) = delete;
+
+  static BCRYPT_ALG_HANDLE provider() {
+    static BCRYPT_ALG_HANDLE alg = [] {
+      BCRYPT_ALG_HANDLE h = nullptr;
+      auto st = ::BCryptOpenAlgorithmProvider(&h, BCRYPT_SHA256_ALGORITHM, nullptr, 0);
+      if (!BCRYPT_SUCCESS(st))
+        throw plx::ComException(__LINE__, HRESULT_FROM_NT(st));
+      return h;
+    }();
+    return alg;
+  }
+
+public:
+  typedef std::array<uint8_t, 32> Digest;
+
+  Sha256() : hash_(nullptr) {
+    auto st = ::BCryptCreateHash(provider(), &hash_, nullptr, 0, nullptr, 0, 0);
+    if (!BCRYPT_SUCCESS(st))
+      throw plx::ComException(__LINE__, HRESULT_FROM_NT(st));
+  }
+
+  ~Sha256() {
+    if (hash_)
+      ::BCryptDestroyHash(hash_);
+  }
+
+  void update(const plx::Range<const uint8_t>& r) {
+    auto st = ::BCryptHashData(hash_, const_cast<uint8_t*>(r.start()),
+                               plx::To<ULONG>(r.size()), 0);
+    if (!BCRYPT_SUCCESS(st))
+      throw plx::ComException(__LINE__, HRESULT_FROM_NT(st));
+  }
+
+  // Can only be called once.
+  Digest finish() {
+    Digest digest;
+    auto st = ::BCryptFinishHash(hash_, &digest[0], ULONG(digest.size()), 0);
+    if (!BCRYPT_SUCCESS(st))
+      throw plx::ComException(__LINE__, HRESULT_FROM_NT(st));
+    return digest;
+  }
+
+  static bool FromHex(const std::string& hex, Digest* digest) {
+    plx::Range<uint8_t> out(&(*digest)[0], digest->size());
+    return plx::BytesFromHexASCII(
+        plx::Range<const char>(hex.c_str(), hex.size()), out);
+  }
+
+  static std::string ToHex(const Digest& digest) {
+    std::string hex(digest.size() * 2, '0');
+    auto out = &hex[0];
+    for (auto b : digest)
+      out = plx::HexASCII(b, out);
+    return hex;
+  }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::BlockCodec (Xpress Huffman blocks via the Windows compression api)
+// compressor_, decompressor_ : handles from cabinet.dll.
+// The api is Windows 8 and later, it is loaded at runtime so older systems
+// still run, available() tells if it can be used.
+//
+class BlockCodec {
+  struct Api {
+    decltype(&::CreateCompressor) create_compressor;
+    decltype(&::Compress) compress;
+    decltype(&::CloseCompressor) close_compressor;
+    decltype(&::CreateDecompressor) create_decompressor;
+    decltype(&::Decompress) decompress;
+    decltype(&::CloseDecompressor) close_decompressor;
+  };
+
+  COMPRESSOR_HANDLE compressor_;
+  DECOMPRESSOR_HANDLE decompressor_;
+
+  BlockCodec(const BlockCodec&) = delete;
+  BlockCodec& operator=(const BlockCodec&) = delete;
+
+  static const Api& api() {
+    static Api api = [] {
+      Api a = {};
+      auto dll = ::LoadLibraryExW(L"cabinet.dll", nullptr, LOAD_LIBRARY_SEARCH_SYSTEM32);
+      if (!dll)
+        return a;
+      a.create_compressor = reinterpret_cast<decltype(a.create_compressor)>(
+          ::GetProcAddress(dll, "CreateCompressor"));
+      a.compress = reinterpret_cast<decltype(a.compress)>(
+          ::GetProcAddress(dll, "Compress"));
+      a.close_compressor = reinterpret_cast<decltype(a.close_compressor)>(
+          ::GetProcAddress(dll, "CloseCompressor"));
+      a.create_decompressor = reinterpret_cast<decltype(a.create_decompressor)>(
+          ::GetProcAddress(dll, "CreateDecompressor"));
+      a.decompress = reinterpret_cast<decltype(a.decompress)>(
+          ::GetProcAddress(dll, "Decompress"));
+      a.close_decompressor = reinterpret_cast<decltype(a.close_decompressor)>(
+          ::GetProcAddress(dll, "CloseDecompressor"));
+      return a;
+    }();
+    return api;
+  }
+
+public:
+  static bool available() {
+    auto& a = api();
+    return a.create_compressor && a.compress && a.close_compressor &&
+           a.create_decompressor && a.decompress && a.close_decompressor;
+  }
+
+  BlockCodec() : compressor_(nullptr), decompressor_(nullptr) {
+    if (!available())
+      throw plx::Kernel32Exception(__LINE__, plx::Kernel32Exception::memory);
+    if (!api().create_compressor(COMPRESS_ALGORITHM_XPRESS_HUFF, nullptr, &compressor_) ||
+        !api().create_decompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, nullptr, &decompressor_)) {
+      if (compressor_)
+        api().close_compressor(compressor_);
+      throw plx::Kernel32Exception(__LINE__, plx::Kernel32Exception::memory);
+    }
+  }
+
+  ~BlockCodec() {
+    api().close_compressor(compressor_);
+    api().close_decompressor(decompressor_);
+  }
+
+  // Appends the compressed |in| to |out|, returns the compressed size.
+  size_t compress(const plx::Range<const uint8_t>& in, std::vector<uint8_t>* out) {
+    auto at = out->size();
+    // Xpress output is never much bigger than the input.
+    out->resize(at + in.size() + (in.size() / 8) + 1024);
+    SIZE_T size = 0;
+    if (!api().compress(compressor_, in.start(), in.size(),
+                        &(*out)[at], out->size() - at, &size)) {
+      out->resize(at);
+      throw plx::Kernel32Exception(__LINE__, plx::Kernel32Exception::memory);
+    }
+    out->resize(at + size);
+    return size;
+  }
+
+  // |out| must be exactly the size of the original data.
+  bool decompress(const plx::Range<const uint8_t>& in, plx::Range<uint8_t>& out) {
+    SIZE_T size = 0;
+    if (!api().decompress(decompressor_, in.start(), in.size(),
+                          out.start(), out.size(), &size))
+      return false;
+    return (size == out.size());
+  }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::ContentChunker (content-defined chunking with a gear rolling hash)
+// min_, max_ : hard limits for the chunk size.
+// mask_ : the hash bits that must be zero to cut. For a shift-left gear hash
+//         the top bits depend on the last 64 bytes so those are used.
+//
+class ContentChunker {
+  size_t min_;
+  size_t max_;
+  uint64_t mask_;
+
+  static const uint64_t* gear() {
+    // splitmix64 from a fixed seed, so every build cuts the same chunks.
+    static const std::array<uint64_t, 256> table = [] {
+      std::array<uint64_t, 256> t;
+      uint64_t x = 0x706c786368756e6bULL;
+      for (auto& g : t) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        g = z ^ (z >> 31);
+      }
+      return t;
+    }();
+    return &table[0];
+  }
+
+public:
+  ContentChunker(size_t min_size, size_t avg_size, size_t max_size)
+      : min_(min_size), max_(max_size), mask_(0) {
+    if (!avg_size || (avg_size & (avg_size - 1)))
+      throw plx::InvalidParamException(__LINE__, 2);
+    if ((min_size >= avg_size) || (avg_size >= max_size))
+      throw plx::InvalidParamException(__LINE__, 1);
+    uint64_t bits = 0;
+    while ((size_t(1) << bits) < avg_size)
+      ++bits;
+    mask_ = ((uint64_t(1) << bits) - 1) << (64 - bits);
+  }
+
+  // Returns the size of the chunk that starts at |r|.
+  size_t next(const plx::Range<const uint8_t>& r) const {
+    if (r.size() <= min_)
+      return r.size();
+    auto end = std::min(r.size(), max_);
+    auto g = gear();
+    uint64_t h = 0;
+    for (size_t ix = min_; ix != end; ++ix) {
+      h = (h << 1) + g[r[ix]];
+      if (!(h & mask_))
+        return ix + 1;
+    }
+    return end;
+  }
+};
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // plx::FileParams
 // access_  : operations allowed to the file.
@@ -736,12 +1279,31 @@ public:
                       FILE_ATTRIBUTE_NORMAL, 0, 0);
   }
 
+  // For files another process keeps writing, like logs.
+  static FileParams Read_ShareAll() {
+    return FileParams(FILE_GENERIC_READ, kShareAll,
+                      OPEN_EXISTING,
+                      FILE_ATTRIBUTE_NORMAL, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+  }
+
   static FileParams ReadWrite_SharedRead(DWORD disposition) {
     return FileParams(FILE_GENERIC_READ | FILE_GENERIC_WRITE, FILE_SHARE_READ,
                       disposition,
                       FILE_ATTRIBUTE_NORMAL, 0, 0);
   }
 
+  static FileParams ReadSequential_SharedRead() {
+    return FileParams(FILE_GENERIC_READ, FILE_SHARE_READ,
+                      OPEN_EXISTING,
+                      FILE_ATTRIBUTE_NORMAL, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+  }
+
+  static FileParams Write_Exclusive(DWORD disposition) {
+    return FileParams(FILE_GENERIC_WRITE, kShareNone,
+                      disposition,
+                      FILE_ATTRIBUTE_NORMAL, 0, 0);
+  }
+
   static FileParams Directory_ShareAll() {
     return FileParams(FILE_GENERIC_READ, kShareAll,
                      OPEN_EXISTING,
@@ -757,6 +1319,7 @@ class File {
   HANDLE handle_;
   unsigned int  status_;
   friend class FilesInfo;
+  friend class MappedFile;
 
 private:
   File(HANDLE handle,
@@ -867,33 +1430,123 @@ public:
     return li.QuadPart;
   }
 
-  size_t read(plx::Range<uint8_t>& mem, unsigned int from = -1) {
+  long long last_write_ns1600() const {
+    FILE_BASIC_INFO fbi = {};
+    if (!::GetFileInformationByHandleEx(handle_, FileBasicInfo, &fbi, sizeof(fbi)))
+      throw IOException(__LINE__, nullptr);
+    return fbi.LastWriteTime.QuadPart;
+  }
+
+  // |from| is a byte offset, -1 means the current file position. Like
+  // pread() the result can be short, a single call moves at most 4GB-1.
+  // Unlike pread() positioned io on a synchronous handle also moves the
+  // file position.
+  size_t read(plx::Range<uint8_t>& mem, long long from = -1) {
     return read(mem.start(), mem.size(), from);
   }
 
-  size_t read(uint8_t* buf, size_t len, int from) {
+  size_t read(uint8_t* buf, size_t len, long long from) {
     OVERLAPPED ov = {0};
-    ov.Offset = from;
     DWORD read = 0;
-    if (!::ReadFile(handle_, buf, static_cast<DWORD>(len),
-                    &read, (from < 0) ? nullptr : &ov))
+    if (!::ReadFile(handle_, buf, ClampLength(len),
+                    &read, SetOffset(from, &ov)))
       return 0;
     return read;
   }
 
-  size_t write(const plx::Range<const uint8_t>& mem, int from = -1) {
+  size_t write(const plx::Range<const uint8_t>& mem, long long from = -1) {
     return write(mem.start(), mem.size(), from);
   }
 
-  size_t write(const uint8_t* buf, size_t len, int from) {
+  size_t write(const uint8_t* buf, size_t len, long long from) {
     OVERLAPPED ov = {0};
-    ov.Offset = from;
     DWORD written = 0;
-    if (!::WriteFile(handle_, buf, static_cast<DWORD>(len),
-                     &written, (from < 0) ? nullptr : &ov))
+    if (!::WriteFile(handle_, buf, ClampLength(len),
+                     &written, SetOffset(from, &ov)))
       return 0;
     return written;
   }
+
+  // Convenience wrappers that move several buffers as if they were one, they
+  // are not true scatter and gather io: ReadFileScatter() and WriteFileGather()
+  // only take whole pages on unbuffered handles. Small batches are copied
+  // through a bounce buffer to make one call, bigger ones take one call per
+  // buffer. Returns the bytes moved, it stops early at the first short
+  // transfer.
+  size_t readv(const plx::Range<const plx::Range<uint8_t>>& mems, long long from = -1) {
+    auto total = TotalSize(mems);
+    if (total <= kVectorCopy) {
+      std::unique_ptr<uint8_t[]> bounce(new uint8_t[total]);
+      auto got = read(bounce.get(), total, from);
+      size_t done = 0;
+      for (auto& mem : mems) {
+        auto sz = std::min(mem.size(), got - done);
+        memcpy(mem.start(), bounce.get() + done, sz);
+        done += sz;
+      }
+      return got;
+    }
+    size_t done = 0;
+    for (auto& mem : mems) {
+      auto at = (from < 0) ? -1LL : from + static_cast<long long>(done);
+      auto got = read(mem.start(), mem.size(), at);
+      done += got;
+      if (got != mem.size())
+        break;
+    }
+    return done;
+  }
+
+  size_t writev(const plx::Range<const plx::Range<const uint8_t>>& mems, long long from = -1) {
+    auto total = TotalSize(mems);
+    if (total <= kVectorCopy) {
+      std::unique_ptr<uint8_t[]> bounce(new uint8_t[total]);
+      size_t done = 0;
+      for (auto& mem : mems) {
+        memcpy(bounce.get() + done, mem.start(), mem.size());
+        done += mem.size();
+      }
+      return write(bounce.get(), total, from);
+    }
+    size_t done = 0;
+    for (auto& mem : mems) {
+      auto at = (from < 0) ? -1LL : from + static_cast<long long>(done);
+      auto put = write(mem.start(), mem.size(), at);
+      done += put;
+      if (put != mem.size())
+        break;
+    }
+    return done;
+  }
+
+  bool flush() {
+    return ::FlushFileBuffers(handle_) ? true : false;
+  }
+
+private:
+  static const size_t kVectorCopy = 64 * 1024;
+
+  static DWORD ClampLength(size_t len) {
+    return static_cast<DWORD>(std::min<size_t>(len, MAXDWORD));
+  }
+
+  static OVERLAPPED* SetOffset(long long from, OVERLAPPED* ov) {
+    if (from < 0)
+      return nullptr;
+    ULARGE_INTEGER ul;
+    ul.QuadPart = from;
+    ov->Offset = ul.LowPart;
+    ov->OffsetHigh = ul.HighPart;
+    return ov;
+  }
+
+  template <typename T>
+  static size_t TotalSize(const plx::Range<const plx::Range<T>>& mems) {
+    size_t total = 0;
+    for (auto& mem : mems)
+      total += mem.size();
+    return total;
+  }
 };
 
 
@@ -919,6 +1572,155 @@ public:
 };
 
 
+///////////////////////////////////////////////////////////////////////////////
+// plx::MappedFile (view of a whole file)
+// mapping_ : the file mapping object.
+// view_ : the mapped bytes, empty for an empty file.
+// writable_ : the view was mapped read-write.
+//
+// Windows has no large pages for file backed sections and its access
+// pattern hints live on the file handle (FILE_FLAG_SEQUENTIAL_SCAN and
+// FILE_FLAG_RANDOM_ACCESS), what is left here is prefetch() and evict().
+//
+class MappedFile {
+  HANDLE mapping_;
+  plx::Range<const uint8_t> view_;
+  bool writable_;
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  MappedFile(HANDLE mapping, const plx::Range<const uint8_t>& view, bool writable)
+      : mapping_(mapping), view_(view), writable_(writable) {
+  }
+
+public:
+  MappedFile() : mapping_(nullptr), writable_(false) {
+  }
+
+  MappedFile(MappedFile&& other) : mapping_(nullptr), writable_(false) {
+    std::swap(mapping_, other.mapping_);
+    std::swap(view_, other.view_);
+    std::swap(writable_, other.writable_);
+  }
+
+  ~MappedFile() {
+    if (view_.start())
+      ::UnmapViewOfFile(view_.start());
+    if (mapping_)
+      ::CloseHandle(mapping_);
+  }
+
+  MappedFile& operator=(MappedFile&& other) {
+    std::swap(mapping_, other.mapping_);
+    std::swap(view_, other.view_);
+    std::swap(writable_, other.writable_);
+    return *this;
+  }
+
+  static MappedFile Create(const plx::File& file) {
+    auto size = file.size_in_bytes();
+    if (!size)
+      return MappedFile();
+    return Map(file, size, false);
+  }
+
+  // |file| needs read and write access. The file grows to |size| if it is
+  // shorter, zero means its current size.
+  static MappedFile CreateWritable(const plx::File& file, long long size = 0) {
+    if (!size)
+      size = file.size_in_bytes();
+    if (!size)
+      return MappedFile();
+    return Map(file, size, true);
+  }
+
+  const plx::Range<const uint8_t>& view() const {
+    return view_;
+  }
+
+  plx::Range<uint8_t> writable_view() const {
+    if (!writable_)
+      throw plx::IOException(__LINE__, L"<file view>");
+    return plx::Range<uint8_t>(const_cast<uint8_t*>(view_.start()), view_.size());
+  }
+
+  // Starts writing the dirty pages to the file. Durability still needs
+  // File::flush() afterwards.
+  bool flush() const {
+    if (!writable_ || view_.empty())
+      return true;
+    return ::FlushViewOfFile(view_.start(), 0) ? true : false;
+  }
+
+  // Brings the whole view into memory with one request. It needs Windows 8,
+  // on older systems it does nothing.
+  void prefetch() const {
+    prefetch(0, view_.size());
+  }
+
+  void prefetch(size_t offset, size_t size) const {
+    typedef BOOL (WINAPI* PrefetchFn)(HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+    static auto fn = reinterpret_cast<PrefetchFn>(::GetProcAddress(
+        ::GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory"));
+    auto r = clamp(offset, size);
+    if (!fn || r.empty())
+      return;
+    WIN32_MEMORY_RANGE_ENTRY range = {
+        const_cast<uint8_t*>(r.start()), r.size() };
+    fn(::GetCurrentProcess(), 1, &range, 0);
+  }
+
+  // The pages are done with: drops them from the working set. They stay in
+  // the file cache so touching them again is a soft fault.
+  void evict(size_t offset, size_t size) const {
+    auto r = clamp(offset, size);
+    if (r.empty())
+      return;
+    // Unlocking pages that are not locked is the documented way to trim
+    // them, it always fails with ERROR_NOT_LOCKED.
+    ::VirtualUnlock(const_cast<uint8_t*>(r.start()), r.size());
+  }
+
+private:
+  static MappedFile Map(const plx::File& file, long long size, bool writable) {
+    ULARGE_INTEGER ul;
+    ul.QuadPart = size;
+    auto mapping = ::CreateFileMappingW(
+        file.handle_, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY,
+        ul.HighPart, ul.LowPart, nullptr);
+    if (!mapping)
+      throw plx::IOException(__LINE__, L"<file mapping>");
+    const void* view = ::MapViewOfFile(
+        mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+      ::CloseHandle(mapping);
+      throw plx::IOException(__LINE__, L"<file view>");
+    }
+    return MappedFile(
+        mapping, plx::RangeFromBytes(view, plx::To<size_t>(size)), writable);
+  }
+
+  plx::Range<const uint8_t> clamp(size_t offset, size_t size) const {
+    if (!size || (offset >= view_.size()))
+      return plx::Range<const uint8_t>();
+    return view_.slice(offset, std::min(size, view_.size() - offset));
+  }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::CopyFileVerified
+// Copies |from| to |to| reading the source once and hashing it on the way.
+// The data goes to a temp file next to |to| that is flushed and renamed
+// into place only if its size and digest match. On failure |to| is left
+// as it was and the temp file is removed.
+//
+bool CopyFileVerified(const plx::FilePath& from, const plx::FilePath& to,
+                      long long expected_size,
+                      const plx::Sha256::Digest& expected) ;
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // plx::JobObjEventHandler
 //
@@ -1086,6 +1888,98 @@ enum class JsonType {
 };
 
 
+///////////////////////////////////////////////////////////////////////////////
+// plx::JsonString (json string text, owned or pointing into the source)
+// view_ : the bytes when they belong to someone else, null when they are in
+//   |owned_|.
+// size_ : the size of |view_|.
+// owned_ : the bytes when the string owns them.
+//
+class JsonString {
+  const char* view_;
+  size_t size_;
+  std::string owned_;
+
+  JsonString(const char* view, size_t size) : view_(view), size_(size) {
+  }
+
+public:
+  JsonString() : view_(nullptr), size_(0) {
+  }
+
+  JsonString(const std::string& s) : view_(nullptr), size_(0), owned_(s) {
+  }
+
+  JsonString(std::string&& s) : view_(nullptr), size_(0), owned_(std::move(s)) {
+  }
+
+  // A copy owns its bytes so it can outlive the text the original points to.
+  JsonString(const JsonString& other)
+      : view_(nullptr), size_(0), owned_(other.data(), other.size()) {
+  }
+
+  JsonString(JsonString&& other) noexcept
+      : view_(other.view_), size_(other.size_), owned_(std::move(other.owned_)) {
+  }
+
+  JsonString& operator=(const JsonString& other) {
+    if (this != &other) {
+      owned_.assign(other.data(), other.size());
+      view_ = nullptr;
+      size_ = 0;
+    }
+    return *this;
+  }
+
+  JsonString& operator=(JsonString&& other) {
+    if (this != &other) {
+      view_ = other.view_;
+      size_ = other.size_;
+      owned_ = std::move(other.owned_);
+    }
+    return *this;
+  }
+
+  // The bytes at |start| must stay put for as long as the string or its
+  // moved-to successors are in use.
+  static JsonString View(const char* start, size_t size) {
+    return JsonString(start ? start : "", size);
+  }
+
+  bool is_view() const {
+    return view_ != nullptr;
+  }
+
+  const char* data() const {
+    return view_ ? view_ : owned_.data();
+  }
+
+  size_t size() const {
+    return view_ ? size_ : owned_.size();
+  }
+
+  plx::Range<const char> range() const {
+    auto s = data();
+    return plx::Range<const char>(s, s + size());
+  }
+
+  std::string str() const {
+    return std::string(data(), size());
+  }
+
+  bool operator<(const JsonString& other) const {
+    auto n = std::min(size(), other.size());
+    auto c = n ? memcmp(data(), other.data(), n) : 0;
+    return c ? (c < 0) : (size() < other.size());
+  }
+
+  bool operator==(const JsonString& other) const {
+    return (size() == other.size()) &&
+           (memcmp(data(), other.data(), size()) == 0);
+  }
+};
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // plx::JsonValue
 // type_ : the actual type from the Data union.
@@ -1095,9 +1989,10 @@ template <typename T> using AligedStore =
 
 class JsonValue {
   //typedef std::unordered_map<std::string, JsonValue> ObjectImpl;
-  typedef std::map<std::string, JsonValue> ObjectImpl;
-  typedef std::vector<JsonValue> ArrayImpl;
-  typedef std::string StringImpl;
+  typedef std::map<plx::JsonString, JsonValue, std::less<plx::JsonString>,
+      plx::ArenaAllocator<std::pair<const plx::JsonString, JsonValue>>> ObjectImpl;
+  typedef std::vector<JsonValue, plx::ArenaAllocator<JsonValue>> ArrayImpl;
+  typedef plx::JsonString StringImpl;
 
   plx::JsonType type_;
   union Data {
@@ -1115,11 +2010,13 @@ class JsonValue {
   JsonValue() : type_(JsonType::NULLT) {
   }
 
-  JsonValue(const plx::JsonType& type) : type_(type) {
+  // Arrays and objects take their memory from |arena|, the heap if null.
+  JsonValue(const plx::JsonType& type, plx::Arena* arena = nullptr) : type_(type) {
     if (type_ == JsonType::ARRAY)
-      new (&u_.arr) ArrayImpl;
+      new (&u_.arr) ArrayImpl(ArrayImpl::allocator_type(arena));
     else if (type_ == JsonType::OBJECT)
-      new (&u_.obj) ObjectImpl();
+      new (&u_.obj) ObjectImpl(ObjectImpl::key_compare(),
+                               ObjectImpl::allocator_type(arena));
     else
       throw plx::InvalidParamException(__LINE__, 1);
   }
@@ -1128,7 +2025,8 @@ class JsonValue {
     *this = other;
   }
 
-  JsonValue(JsonValue&& other) : type_(JsonType::NULLT) {
+  // noexcept so that vectors of values move them when they grow.
+  JsonValue(JsonValue&& other) noexcept : type_(JsonType::NULLT) {
     *this = std::move(other);
   }
 
@@ -1156,7 +2054,11 @@ class JsonValue {
   }
 
   JsonValue(const std::string& s) : type_(JsonType::STRING) {
-    new (&u_.str) std::string(s);
+    new (&u_.str) StringImpl(s);
+  }
+
+  JsonValue(plx::JsonString&& s) : type_(JsonType::STRING) {
+    new (&u_.str) StringImpl(std::move(s));
   }
 
   JsonValue(const char* s) : type_(JsonType::STRING) {
@@ -1172,6 +2074,11 @@ class JsonValue {
     new (&u_.arr) ArrayImpl(first, last);
   }
 
+  template<class It>
+  JsonValue(It first, It last, plx::Arena* arena) : type_(JsonType::ARRAY) {
+    new (&u_.arr) ArrayImpl(first, last, ArrayImpl::allocator_type(arena));
+  }
+
   JsonValue& operator=(const JsonValue& other) {
     if (this != &other) {
       Destroy();
@@ -1217,7 +2124,15 @@ class JsonValue {
   }
 
   JsonValue& operator[](const std::string& s) {
-    return (*GetObject())[s];
+    auto obj = GetObject();
+    auto it = obj->find(plx::JsonString::View(s.data(), s.size()));
+    if (it != obj->end())
+      return it->second;
+    return (*obj)[plx::JsonString(s)];
+  }
+
+  JsonValue& operator[](plx::JsonString&& s) {
+    return (*GetObject())[std::move(s)];
   }
 
   JsonValue& operator[](size_t ix) {
@@ -1241,11 +2156,17 @@ class JsonValue {
   }
 
   std::string get_string() const {
-    return *GetString();
+    return GetString()->str();
+  }
+
+  // The string without a copy, valid as long as this value is.
+  plx::Range<const char> get_range() const {
+    return GetString()->range();
   }
 
   bool has_key(const std::string& k) const {
-    return (GetObject()->find(k) != end(*GetObject()));
+    auto obj = GetObject();
+    return (obj->find(plx::JsonString::View(k.data(), k.size())) != end(*obj));
   }
 
   std::pair<KeyValueIterator, KeyValueIterator>  get_iterator() const {
@@ -1253,7 +2174,7 @@ class JsonValue {
   }
 
   void push_back(JsonValue&& value) {
-    GetArray()->push_back(value);
+    GetArray()->push_back(std::move(value));
   }
 
   size_t size() const {
@@ -1294,14 +2215,14 @@ class JsonValue {
     return reinterpret_cast<const ArrayImpl*>(addr);
   }
 
-  std::string* GetString() {
+  StringImpl* GetString() {
     if (type_ != JsonType::STRING)
       throw plx::JsonException(__LINE__);
     void* addr = &u_.str;
     return reinterpret_cast<StringImpl*>(addr);
   }
 
-  const std::string* GetString() const {
+  const StringImpl* GetString() const {
     if (type_ != JsonType::STRING)
       throw plx::JsonException(__LINE__);
     const void* addr = &u_.str;
@@ -1436,6 +2357,9 @@ To(const Src & value) {
 
 ///////////////////////////////////////////////////////////////////////////////
 // plx::FilesInfo
+// stream_ : when valid, entries are read one buffer at a time from it.
+// filter_ : the entries the iteration skips, see |Filter|.
+// prefix_ : when not empty, only names starting with it (case sensitive).
 //
 #pragma comment(user, "plex.define=plex_vista_support")
 
@@ -1444,80 +2368,364 @@ private:
   FILE_ID_BOTH_DIR_INFO* info_;
   plx::LinkedBuffers link_buffs_;
   mutable bool done_;
+  HANDLE stream_;
+  size_t buffer_size_;
+  unsigned int filter_;
+  std::wstring prefix_;
 
 private:
-  FilesInfo() : info_(nullptr), done_(false) {}
+  FilesInfo()
+      : info_(nullptr), done_(false),
+        stream_(INVALID_HANDLE_VALUE), buffer_size_(0), filter_(0) {}
   FilesInfo(const FilesInfo&) = delete;
 
 public:
-  static FilesInfo FromDir(plx::File& file, long buffer_hint = 32) {
+  enum Filter {
+    all_entries   = 0,
+    dirs_only     = 1,
+    files_only    = 2,
+    skip_dots     = 4,   // the "." and ".." entries.
+  };
+
+  static FilesInfo FromDir(plx::File& file, long buffer_hint = 512) {
+    if (file.status() != (plx::File::directory | plx::File::existing))
+      throw plx::IOException(__LINE__, nullptr);
+
+    FilesInfo finf;
+    finf.fill(file, buffer_hint);
+    return std::move(finf);
+  }
+
+  // Reads the entries as the iteration reaches them, so memory stays at one
+  // buffer and the first entry does not wait for the whole directory. Every
+  // first() restarts the scan. |file| must outlive the FilesInfo.
+  static FilesInfo Stream(plx::File& file,
+                          unsigned int filter,
+                          const std::wstring& prefix = std::wstring(),
+                          long buffer_hint = 512) {
     if (file.status() != (plx::File::directory | plx::File::existing))
       throw plx::IOException(__LINE__, nullptr);
 
     FilesInfo finf;
-    // |buffer_size| controls the tradeoff between speed and memory use.
-    const size_t buffer_size = buffer_hint * 128;
+    finf.stream_ = file.handle_;
+    finf.buffer_size_ = BufferSize(buffer_hint);
+    finf.filter_ = filter;
+    finf.prefix_ = prefix;
+    return std::move(finf);
+  }
+
+  FilesInfo(FilesInfo&& other)
+      : link_buffs_(std::move(other.link_buffs_)),
+        stream_(other.stream_),
+        buffer_size_(other.buffer_size_),
+        filter_(other.filter_),
+        prefix_(std::move(other.prefix_)) {
+    std::swap(info_, other.info_);
+    std::swap(done_, other.done_);
+    other.stream_ = INVALID_HANDLE_VALUE;
+  }
+
+  void first() {
+    if (stream_ != INVALID_HANDLE_VALUE) {
+      done_ = !fetch(true);
+    } else {
+      link_buffs_.first();
+      done_ = link_buffs_.done();
+      if (!done_)
+        info_ = reinterpret_cast<FILE_ID_BOTH_DIR_INFO*>(link_buffs_.get().start());
+    }
+    skip_unwanted();
+  }
+
+  void next() {
+    advance();
+    skip_unwanted();
+  }
+
+  bool done() const {
+    return done_;
+  }
+
+  const plx::ItRange<wchar_t*> file_name() const {
+    return plx::ItRange<wchar_t*>(
+      info_->FileName,
+      info_->FileName+ (info_->FileNameLength / sizeof(wchar_t)));
+  }
+
+  long long creation_ns1600() const {
+    return info_->CreationTime.QuadPart;
+  }
+
+  // The accessors below are served from the directory record, there is no
+  // need to open the file.
+  long long last_write_ns1600() const {
+    return info_->LastWriteTime.QuadPart;
+  }
+
+  long long size_in_bytes() const {
+    return info_->EndOfFile.QuadPart;
+  }
+
+  // Same as File::get_unique_id().
+  long long file_id() const {
+    return info_->FileId.QuadPart;
+  }
+
+  unsigned long attributes() const {
+    return info_->FileAttributes;
+  }
+
+  bool is_directory() const {
+    return info_->FileAttributes & FILE_ATTRIBUTE_DIRECTORY? true : false;
+  }
+
+private:
+  // The buffer size controls the tradeoff between speed and memory use. Each
+  // buffer costs a system call, the floor fits a few max-length names.
+  static size_t BufferSize(long buffer_hint) {
+    return std::max(buffer_hint * 128L, 4096L);
+  }
+
+  void advance() {
+    if (info_->NextEntryOffset) {
+      info_ = reinterpret_cast<FILE_ID_BOTH_DIR_INFO*>(
+          ULONG_PTR(info_) + info_->NextEntryOffset);
+    } else if (stream_ != INVALID_HANDLE_VALUE) {
+      done_ = !fetch(false);
+    } else {
+      // last entry of this buffer. Move to next buffer.
+      link_buffs_.next();
+      if (link_buffs_.done()) {
+        done_ = true;
+      } else {
+        info_ = reinterpret_cast<FILE_ID_BOTH_DIR_INFO*>(link_buffs_.get().start());
+      }
+    }
+  }
+
+  // Entries are tested in place in the kernel's buffer, rejected ones are
+  // never copied anywhere.
+  bool wanted() const {
+    if (filter_ & (dirs_only | files_only)) {
+      if (((filter_ & dirs_only) != 0) != is_directory())
+        return false;
+    }
+    auto len = info_->FileNameLength / sizeof(wchar_t);
+    if (filter_ & skip_dots) {
+      if ((info_->FileName[0] == L'.') &&
+          ((len == 1) || ((len == 2) && (info_->FileName[1] == L'.'))))
+        return false;
+    }
+    if (!prefix_.empty()) {
+      if (len < prefix_.size())
+        return false;
+      if (wmemcmp(info_->FileName, prefix_.c_str(), prefix_.size()) != 0)
+        return false;
+    }
+    return true;
+  }
+
+  void skip_unwanted() {
+    while (!done_ && !wanted())
+      advance();
+  }
+
+  // Streaming mode: replaces the single buffer with the next batch.
+  bool fetch(bool restart) {
+    link_buffs_.reset();
+    auto data = link_buffs_.new_buffer(buffer_size_);
+    if (!::GetFileInformationByHandleEx(
+        stream_,
+        restart ? FileIdBothDirectoryRestartInfo: FileIdBothDirectoryInfo,
+        data.start(), plx::To<DWORD>(data.size()))) {
+      if (::GetLastError() != ERROR_NO_MORE_FILES)
+        throw plx::IOException(__LINE__, nullptr);
+      return false;
+    }
+    info_ = reinterpret_cast<FILE_ID_BOTH_DIR_INFO*>(data.start());
+    return true;
+  }
+
+  void fill(plx::File& file, long buffer_hint) {
+    const size_t buffer_size = BufferSize(buffer_hint);
 
-    plx::Range<unsigned char> data;
     for (size_t count = 0; ;++count) {
-      data = finf.link_buffs_.new_buffer(buffer_size);
+      auto data = link_buffs_.new_buffer(buffer_size);
       if (!::GetFileInformationByHandleEx(
           file.handle_,
           count == 0 ? FileIdBothDirectoryRestartInfo: FileIdBothDirectoryInfo,
           data.start(), plx::To<DWORD>(data.size()))) {
+        // The last buffer has nothing in it, give it back.
+        link_buffs_.remove_last_buffer();
         if (::GetLastError() != ERROR_NO_MORE_FILES)
           throw plx::IOException(__LINE__, nullptr);
         break;
       }
+      // Return the space past the last record so the next call packs
+      // right after it.
+      link_buffs_.shrink_last_buffer(UsedBytes(data.start()));
     }
-    // The last buffer contains garbage. remove it.
-    finf.link_buffs_.remove_last_buffer();
-    return std::move(finf);
   }
 
-  FilesInfo(FilesInfo&& other)
-      : link_buffs_(std::move(other.link_buffs_)) {
+  static size_t UsedBytes(uint8_t* start) {
+    auto info = reinterpret_cast<FILE_ID_BOTH_DIR_INFO*>(start);
+    while (info->NextEntryOffset)
+      info = reinterpret_cast<FILE_ID_BOTH_DIR_INFO*>(
+          ULONG_PTR(info) + info->NextEntryOffset);
+    auto end = reinterpret_cast<uint8_t*>(&info->FileName[0]) + info->FileNameLength;
+    return end - start;
+  }
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::DirChanges (directory change notifications via ReadDirectoryChangesW)
+// dir_ : the watched directory, opened for overlapped io.
+// ov_  : the outstanding request, on the heap so moves don't disturb it.
+// buf_ : receives the FILE_NOTIFY_INFORMATION records.
+// info_ : the current record when iterating.
+//
+class DirChanges {
+  HANDLE dir_;
+  DWORD filter_;
+  std::unique_ptr<OVERLAPPED> ov_;
+  std::unique_ptr<uint8_t[]> buf_;
+  DWORD buf_size_;
+  DWORD read_;
+  FILE_NOTIFY_INFORMATION* info_;
+
+  DirChanges(const DirChanges&) = delete;
+  DirChanges& operator=(const DirChanges&) = delete;
+
+  DirChanges(HANDLE dir, DWORD filter, DWORD buf_size)
+      : dir_(dir), filter_(filter), ov_(new OVERLAPPED()),
+        buf_(new uint8_t[buf_size]), buf_size_(buf_size),
+        read_(0), info_(nullptr) {
+    ov_->hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!ov_->hEvent)
+      throw plx::Kernel32Exception(__LINE__, plx::Kernel32Exception::waitable);
+  }
+
+public:
+  enum Action {
+    added,
+    removed,
+    modified,
+  };
+
+  DirChanges()
+      : dir_(INVALID_HANDLE_VALUE), filter_(0),
+        buf_size_(0), read_(0), info_(nullptr) {
+  }
+
+  DirChanges(DirChanges&& other)
+      : dir_(INVALID_HANDLE_VALUE), filter_(0),
+        buf_size_(0), read_(0), info_(nullptr) {
+    *this = std::move(other);
+  }
+
+  DirChanges& operator=(DirChanges&& other) {
+    std::swap(dir_, other.dir_);
+    std::swap(filter_, other.filter_);
+    std::swap(ov_, other.ov_);
+    std::swap(buf_, other.buf_);
+    std::swap(buf_size_, other.buf_size_);
+    std::swap(read_, other.read_);
     std::swap(info_, other.info_);
-    std::swap(done_, other.done_);
+    return *this;
+  }
+
+  ~DirChanges() {
+    if (dir_ != INVALID_HANDLE_VALUE) {
+      ::CancelIoEx(dir_, ov_.get());
+      DWORD bytes;
+      ::GetOverlappedResult(dir_, ov_.get(), &bytes, TRUE);
+      ::CloseHandle(dir_);
+    }
+    if (ov_ && ov_->hEvent)
+      ::CloseHandle(ov_->hEvent);
+  }
+
+  // Starts watching |path| right away. Changes that happen between polls
+  // are buffered by the kernel so nothing is lost after Create() returns.
+  static DirChanges Create(const plx::FilePath& path,
+                           DWORD filter, DWORD buf_size = 16 * 1024) {
+    auto dir = ::CreateFileW(path.raw(), FILE_LIST_DIRECTORY,
+                             plx::FileParams::kShareAll, nullptr,
+                             OPEN_EXISTING,
+                             FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+                             nullptr);
+    if (dir == INVALID_HANDLE_VALUE)
+      return DirChanges();
+    DirChanges dc(dir, filter, buf_size);
+    if (!dc.rearm())
+      return DirChanges();
+    return dc;
+  }
+
+  bool is_valid() const {
+    return (dir_ != INVALID_HANDLE_VALUE);
+  }
+
+  // Non-blocking. Returns true when there are records to walk with first()
+  // and friends. |overflow| is set when the kernel dropped records, in which
+  // case the caller should rescan the directory. Call rearm() when done.
+  bool poll(bool* overflow) {
+    *overflow = false;
+    if (!::GetOverlappedResult(dir_, ov_.get(), &read_, FALSE)) {
+      auto gle = ::GetLastError();
+      if (gle == ERROR_IO_INCOMPLETE)
+        return false;
+      if (gle != ERROR_NOTIFY_ENUM_DIR)
+        throw plx::IOException(__LINE__, L"<dir changes>");
+      read_ = 0;
+    }
+    if (!read_)
+      *overflow = true;
+    return true;
+  }
+
+  bool rearm() {
+    read_ = 0;
+    info_ = nullptr;
+    ::ResetEvent(ov_->hEvent);
+    return ::ReadDirectoryChangesW(dir_, buf_.get(), buf_size_, FALSE,
+                                   filter_, nullptr, ov_.get(), nullptr) ?
+        true : false;
   }
 
   void first() {
-    done_ = false;
-    link_buffs_.first();
-    info_ = reinterpret_cast<FILE_ID_BOTH_DIR_INFO*>(link_buffs_.get().start());
+    info_ = read_ ? reinterpret_cast<FILE_NOTIFY_INFORMATION*>(buf_.get()) :
+                    nullptr;
   }
 
   void next() {
-    if (!info_->NextEntryOffset) {
-      // last entry of this buffer. Move to next buffer.
-      link_buffs_.next();
-      if (link_buffs_.done()) {
-        done_ = true;
-      } else {
-        info_ = reinterpret_cast<FILE_ID_BOTH_DIR_INFO*>(link_buffs_.get().start());
-      }
-    } else {
-      info_ =reinterpret_cast<FILE_ID_BOTH_DIR_INFO*>(
-          ULONG_PTR(info_) + info_->NextEntryOffset);
-    }
+    info_ = info_->NextEntryOffset ?
+        reinterpret_cast<FILE_NOTIFY_INFORMATION*>(
+            ULONG_PTR(info_) + info_->NextEntryOffset) : nullptr;
   }
 
   bool done() const {
-    return done_;
+    return (info_ == nullptr);
+  }
+
+  Action action() const {
+    switch (info_->Action) {
+      case FILE_ACTION_ADDED:
+      case FILE_ACTION_RENAMED_NEW_NAME:
+        return added;
+      case FILE_ACTION_REMOVED:
+      case FILE_ACTION_RENAMED_OLD_NAME:
+        return removed;
+      default:
+        return modified;
+    }
   }
 
   const plx::ItRange<wchar_t*> file_name() const {
     return plx::ItRange<wchar_t*>(
       info_->FileName,
-      info_->FileName+ (info_->FileNameLength / sizeof(wchar_t)));
-  }
-
-  long long creation_ns1600() const {
-    return info_->CreationTime.QuadPart;
-  }
-
-  bool is_directory() const {
-    return info_->FileAttributes & FILE_ATTRIBUTE_DIRECTORY? true : false;
+      info_->FileName + (info_->FileNameLength / sizeof(wchar_t)));
   }
 };
 
@@ -1866,6 +3074,559 @@ private:
 };
 
 
+///////////////////////////////////////////////////////////////////////////////
+// plx::JsonScanner (finds the structure of json text, 64 bytes at a time)
+// Reports the offsets of { } [ ] : , outside of strings, of the opening
+// quote of each string and of the first byte of each other scalar. The
+// bytes are classified into bit masks with SSE2, plain code elsewhere, and
+// the strings are found with a prefix xor of the unescaped quotes. The
+// state is kept between blocks so the text can come in pieces.
+// in_string_ : all ones when the last block ended inside a string.
+// odd_escape_ : one when the last block ended in an odd run of backslashes.
+// in_scalar_ : one when the last byte of the last block is part of a scalar.
+//
+class JsonScanner {
+  uint64_t in_string_;
+  uint64_t odd_escape_;
+  uint64_t in_scalar_;
+
+  struct Masks {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op;
+    uint64_t space;
+  };
+
+public:
+  static const size_t kBlock = 64;
+
+  JsonScanner() : in_string_(0), odd_escape_(0), in_scalar_(0) {
+  }
+
+  bool in_string() const {
+    return in_string_ != 0;
+  }
+
+  // Scans |size| bytes, at most kBlock. The offsets are appended to |out|
+  // with |base| added.
+  void scan(const char* text, size_t size, uint32_t base, std::vector<uint32_t>* out) {
+    Masks m;
+    if (size == kBlock) {
+      Classify(text, &m);
+    } else {
+      // Spaces change nothing, a short block is padded with them.
+      char block[kBlock];
+      memset(block, ' ', kBlock);
+      memcpy(block, text, size);
+      Classify(block, &m);
+    }
+
+    auto quote = m.quote & ~escaped(m.backslash);
+    // From an opening quote to the byte before the closing one.
+    auto strings = PrefixXor(quote) ^ in_string_;
+    in_string_ = 0 - (strings >> 63);
+    auto scalar = ~(m.op | m.space | quote | strings);
+    auto scalar_starts = scalar & ~((scalar << 1) | in_scalar_);
+    in_scalar_ = scalar >> 63;
+
+    auto found = (m.op & ~strings) | (quote & strings) | scalar_starts;
+    while (found) {
+      out->push_back(base + LowestBit(found));
+      found &= found - 1;
+    }
+  }
+
+  // The number of bytes before the first quote, backslash or control
+  // character, that is the part of a string that needs no decoding.
+  static size_t StringRun(const char* text, size_t size) {
+    size_t ix = 0;
+#if defined(_M_IX86) || defined(_M_X64)
+    const auto quote = _mm_set1_epi8('\"');
+    const auto backslash = _mm_set1_epi8('\\');
+    const auto k1f = _mm_set1_epi8(0x1f);
+    for (; size - ix >= 16; ix += 16) {
+      auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + ix));
+      // A byte is below 0x20 when the unsigned max with 0x1f is 0x1f.
+      auto special = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+          _mm_cmpeq_epi8(_mm_max_epu8(v, k1f), k1f));
+      auto bits = _mm_movemask_epi8(special);
+      if (bits)
+        return ix + LowestBit(static_cast<uint64_t>(bits));
+    }
+#endif
+    for (; ix != size; ++ix) {
+      auto c = static_cast<uint8_t>(text[ix]);
+      if ((c == '\"') || (c == '\\') || (c < 0x20))
+        break;
+    }
+    return ix;
+  }
+
+  void scan_all(const char* text, size_t size, std::vector<uint32_t>* out) {
+    auto total = plx::To<uint32_t>(size);
+    out->reserve(out->size() + (size / 8));
+    uint32_t ix = 0;
+    for (; total - ix >= kBlock; ix += kBlock)
+      scan(text + ix, kBlock, ix, out);
+    if (ix != total)
+      scan(text + ix, total - ix, ix, out);
+  }
+
+private:
+  // The bytes that follow an odd run of backslashes.
+  uint64_t escaped(uint64_t backslash) {
+    const uint64_t even = 0x5555555555555555ULL;
+    const uint64_t odd = ~even;
+    auto starts = backslash & ~(backslash << 1);
+    auto even_start_mask = even ^ odd_escape_;
+    auto even_starts = starts & even_start_mask;
+    auto odd_starts = starts & ~even_start_mask;
+    auto even_carries = backslash + even_starts;
+    auto odd_carries = backslash + odd_starts;
+    auto overflow = odd_carries < backslash;
+    odd_carries |= odd_escape_;
+    odd_escape_ = overflow ? 1 : 0;
+    auto even_carry_ends = even_carries & ~backslash;
+    auto odd_carry_ends = odd_carries & ~backslash;
+    return (even_carry_ends & odd) | (odd_carry_ends & even);
+  }
+
+  static uint64_t PrefixXor(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+  }
+
+  static unsigned long LowestBit(uint64_t bits) {
+    unsigned long ix;
+#if defined(_M_X64) || defined(_M_ARM64)
+    _BitScanForward64(&ix, bits);
+#else
+    if (!_BitScanForward(&ix, static_cast<unsigned long>(bits))) {
+      _BitScanForward(&ix, static_cast<unsigned long>(bits >> 32));
+      ix += 32;
+    }
+#endif
+    return ix;
+  }
+
+#if defined(_M_IX86) || defined(_M_X64)
+  static uint64_t MoveMask(const __m128i (&v)[4]) {
+    return uint64_t(uint16_t(_mm_movemask_epi8(v[0]))) |
+           (uint64_t(uint16_t(_mm_movemask_epi8(v[1]))) << 16) |
+           (uint64_t(uint16_t(_mm_movemask_epi8(v[2]))) << 32) |
+           (uint64_t(uint16_t(_mm_movemask_epi8(v[3]))) << 48);
+  }
+
+  static void Classify(const char* text, Masks* m) {
+    // '[' and ']' become '{' and '}' with the 0x20 bit set.
+    const auto k20 = _mm_set1_epi8(0x20);
+    __m128i quote[4], backslash[4], op[4], space[4];
+    for (int ix = 0; ix != 4; ++ix) {
+      auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + (16 * ix)));
+      auto lower = _mm_or_si128(v, k20);
+      quote[ix] = _mm_cmpeq_epi8(v, _mm_set1_epi8('\"'));
+      backslash[ix] = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+      op[ix] = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')),
+                       _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+          _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                       _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+      space[ix] = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                       _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+          _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                       _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    }
+    m->quote = MoveMask(quote);
+    m->backslash = MoveMask(backslash);
+    m->op = MoveMask(op);
+    m->space = MoveMask(space);
+  }
+#else
+  static void Classify(const char* text, Masks* m) {
+    memset(m, 0, sizeof(*m));
+    for (size_t ix = 0; ix != kBlock; ++ix) {
+      auto bit = 1ULL << ix;
+      switch (text[ix]) {
+        case '\"': m->quote |= bit; break;
+        case '\\': m->backslash |= bit; break;
+        case '{': case '}': case '[': case ']': case ':': case ',':
+          m->op |= bit; break;
+        case ' ': case '\t': case '\n': case '\r':
+          m->space |= bit; break;
+      }
+    }
+  }
+#endif
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::JsonToken
+//
+enum class JsonToken {
+  MORE,
+  END,
+  BEGIN_OBJECT,
+  END_OBJECT,
+  BEGIN_ARRAY,
+  END_ARRAY,
+  KEY,
+  STRING,
+  INT64,
+  DOUBLE,
+  BOOL,
+  NULLT,
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::JsonReader (pull parser for json text that arrives in pieces)
+// Returns one token at a time, MORE when it needs feed() and END after
+// finish() once every value is read. Values can follow each other at the
+// top level, so newline separated json reads as is. Memory stays bounded:
+// the text already read is dropped on feed(), a token longer than
+// |max_token_| or nesting deeper than kMaxDepth throws.
+// buf_ : the text fed, read up to |pos_|.
+// finished_ : no more text comes.
+// open_ : '{' or '[' for each array and object being read.
+// expect_ : what can come next.
+// range_ : the last key or string, in |buf_| or in |decoded_|.
+// skip_depth_ : the brackets skip() has to close, zero when not skipping.
+// scanner_ : finds the brackets for skip().
+//
+class JsonReader {
+  enum class Expect {
+    VALUE,
+    VALUE_OR_END,
+    KEY_OR_END,
+    COLON,
+    COMMA_OR_END
+  };
+
+  static const size_t kMaxDepth = 1024;
+
+  std::vector<char> buf_;
+  size_t pos_;
+  size_t max_token_;
+  bool finished_;
+  std::vector<char> open_;
+  Expect expect_;
+  plx::Range<const char> range_;
+  std::string decoded_;
+  int64_t intv_;
+  double dblv_;
+  bool bolv_;
+  size_t skip_depth_;
+  plx::JsonScanner scanner_;
+  std::vector<uint32_t> offsets_;
+
+public:
+  explicit JsonReader(size_t max_token = 1024 * 1024)
+      : pos_(0), max_token_(max_token), finished_(false),
+        expect_(Expect::VALUE), intv_(0), dblv_(0.0), bolv_(false),
+        skip_depth_(0) {
+  }
+
+  // The bytes already read are dropped first, so the buffer holds at most
+  // a partial token and the new text.
+  void feed(const char* text, size_t size) {
+    if (finished_)
+      throw plx::InvalidParamException(__LINE__, 1);
+    buf_.erase(begin(buf_), begin(buf_) + pos_);
+    pos_ = 0;
+    buf_.insert(end(buf_), text, text + size);
+  }
+
+  void finish() {
+    finished_ = true;
+  }
+
+  size_t depth() const {
+    return open_.size();
+  }
+
+  JsonToken next() {
+    if (skip_depth_)
+      throw plx::InvalidParamException(__LINE__, 0);
+    for (;;) {
+      while ((pos_ != buf_.size()) && IsSpace(buf_[pos_]))
+        ++pos_;
+      if (pos_ == buf_.size()) {
+        if (!finished_)
+          return JsonToken::MORE;
+        if (open_.empty() && (expect_ == Expect::VALUE))
+          return JsonToken::END;
+        throw plx::CodecException(__LINE__, nullptr);
+      }
+
+      auto c = buf_[pos_];
+      switch (expect_) {
+        case Expect::COLON:
+          if (c != ':')
+            break;
+          ++pos_;
+          expect_ = Expect::VALUE;
+          continue;
+        case Expect::COMMA_OR_END:
+          if (c != ',')
+            return close(c);
+          // A trailing comma is fine, like in ParseJsonValue().
+          ++pos_;
+          expect_ = (open_.back() == '{') ? Expect::KEY_OR_END : Expect::VALUE_OR_END;
+          continue;
+        case Expect::KEY_OR_END:
+          if (c == '\"')
+            return string(JsonToken::KEY);
+          return close(c);
+        case Expect::VALUE_OR_END:
+          if (c == ']')
+            return close(c);
+          return value(c);
+        case Expect::VALUE:
+          return value(c);
+      }
+      auto r = plx::RangeFromBytes(&buf_[pos_], 1);
+      throw plx::CodecException(__LINE__, &r);
+    }
+  }
+
+  // Reads past the end of the innermost open array or object, after
+  // BEGIN_OBJECT or BEGIN_ARRAY it leaves out the whole subtree. Only the
+  // brackets outside of strings are looked at, the rest is not checked.
+  // Returns false when it needs feed(), then it must be called again.
+  bool skip() {
+    if (!skip_depth_) {
+      if (open_.empty())
+        throw plx::InvalidParamException(__LINE__, 0);
+      skip_depth_ = 1;
+      scanner_ = plx::JsonScanner();
+    }
+    const size_t block = plx::JsonScanner::kBlock;
+    for (;;) {
+      auto left = buf_.size() - pos_;
+      if (left < block) {
+        if (!finished_)
+          return false;
+        if (!left)
+          throw plx::CodecException(__LINE__, nullptr);
+      }
+      auto size = std::min(left, block);
+      offsets_.clear();
+      scanner_.scan(&buf_[pos_], size, 0, &offsets_);
+      for (auto off : offsets_) {
+        auto c = buf_[pos_ + off];
+        if ((c == '{') || (c == '[')) {
+          ++skip_depth_;
+        } else if (((c == '}') || (c == ']')) && !--skip_depth_) {
+          pos_ += off + 1;
+          open_.pop_back();
+          expect_ = after_value();
+          return true;
+        }
+      }
+      pos_ += size;
+    }
+  }
+
+  // For KEY and STRING. Valid until the reader is used again.
+  plx::Range<const char> get_range() const {
+    return range_;
+  }
+
+  std::string get_string() const {
+    return std::string(range_.start(), range_.end());
+  }
+
+  int64_t get_int64() const {
+    return intv_;
+  }
+
+  double get_double() const {
+    return dblv_;
+  }
+
+  bool get_bool() const {
+    return bolv_;
+  }
+
+private:
+  static bool IsSpace(char c) {
+    return (c == ' ') || (c == '\t') || (c == '\n') || (c == '\r');
+  }
+
+  // What can follow a number or a literal.
+  static bool IsDelimiter(char c) {
+    switch (c) {
+      case ',': case ':': case ']': case '}': case '[': case '{': case '\"':
+        return true;
+      default:
+        return IsSpace(c);
+    }
+  }
+
+  static bool IsNumberChar(char c) {
+    if ((c >= '0') && (c <= '9'))
+      return true;
+    switch (c) {
+      case '-': case '+': case '.': case 'e': case 'E':
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  Expect after_value() const {
+    return open_.empty() ? Expect::VALUE : Expect::COMMA_OR_END;
+  }
+
+  // The token at |pos_| is not all there yet.
+  JsonToken more() {
+    if (finished_ || (buf_.size() - pos_ > max_token_)) {
+      auto r = plx::RangeFromBytes(&buf_[pos_], 1);
+      throw plx::CodecException(__LINE__, &r);
+    }
+    return JsonToken::MORE;
+  }
+
+  JsonToken open(char c, JsonToken token, Expect expect) {
+    if (open_.size() == kMaxDepth)
+      throw plx::CodecException(__LINE__, nullptr);
+    open_.push_back(c);
+    ++pos_;
+    expect_ = expect;
+    return token;
+  }
+
+  JsonToken close(char c) {
+    if (!open_.empty() && (c == open_.back() + 2)) {
+      // '{' + 2 is '}' and '[' + 2 is ']'.
+      auto token = (c == '}') ? JsonToken::END_OBJECT : JsonToken::END_ARRAY;
+      open_.pop_back();
+      ++pos_;
+      expect_ = after_value();
+      return token;
+    }
+    auto r = plx::RangeFromBytes(&buf_[pos_], 1);
+    throw plx::CodecException(__LINE__, &r);
+  }
+
+  JsonToken value(char c) {
+    switch (c) {
+      case '{':
+        return open(c, JsonToken::BEGIN_OBJECT, Expect::KEY_OR_END);
+      case '[':
+        return open(c, JsonToken::BEGIN_ARRAY, Expect::VALUE_OR_END);
+      case '\"':
+        return string(JsonToken::STRING);
+      case 't':
+        bolv_ = true;
+        return literal("true", JsonToken::BOOL);
+      case 'f':
+        bolv_ = false;
+        return literal("false", JsonToken::BOOL);
+      case 'n':
+        return literal("null", JsonToken::NULLT);
+      default:
+        return number();
+    }
+  }
+
+  JsonToken string(JsonToken token) {
+    auto start = buf_.data() + pos_ + 1;
+    auto size = buf_.size() - pos_ - 1;
+    size_t ix = 0;
+    bool escapes = false;
+    for (;;) {
+      if (ix < size)
+        ix += plx::JsonScanner::StringRun(start + ix, size - ix);
+      if (ix >= size)
+        return more();
+      if (start[ix] == '\"')
+        break;
+      if (start[ix] != '\\') {
+        auto r = plx::RangeFromBytes(start + ix, 1);
+        throw plx::CodecException(__LINE__, &r);
+      }
+      escapes = true;
+      ix += 2;
+    }
+
+    if (escapes) {
+      plx::Range<const char> r(start - 1, start + ix + 1);
+      decoded_ = plx::DecodeString(r);
+      range_ = plx::Range<const char>(decoded_.data(), decoded_.data() + decoded_.size());
+    } else {
+      range_ = plx::Range<const char>(start, start + ix);
+    }
+    pos_ += ix + 2;
+    expect_ = (token == JsonToken::KEY) ? Expect::COLON : after_value();
+    return token;
+  }
+
+  template <size_t count>
+  JsonToken literal(const char (&lit)[count], JsonToken token) {
+    const auto len = count - 1;
+    auto left = buf_.size() - pos_;
+    if (memcmp(&buf_[pos_], lit, std::min(left, len)) != 0) {
+      auto r = plx::RangeFromBytes(&buf_[pos_], std::min(left, len));
+      throw plx::CodecException(__LINE__, &r);
+    }
+    // Without the byte after it "true" could still be "truex".
+    if ((left < len) || ((left == len) && !finished_))
+      return more();
+    if ((left != len) && !IsDelimiter(buf_[pos_ + len])) {
+      auto r = plx::RangeFromBytes(&buf_[pos_], len + 1);
+      throw plx::CodecException(__LINE__, &r);
+    }
+    pos_ += len;
+    expect_ = after_value();
+    return token;
+  }
+
+  JsonToken number() {
+    auto left = buf_.size() - pos_;
+    size_t len = 0;
+    while ((len != left) && IsNumberChar(buf_[pos_ + len]))
+      ++len;
+    if ((len == left) && !finished_)
+      return more();
+    if (!len || ((len != left) && !IsDelimiter(buf_[pos_ + len]))) {
+      auto r = plx::RangeFromBytes(&buf_[pos_], len + 1);
+      throw plx::CodecException(__LINE__, &r);
+    }
+
+    // Integers too big for 64 bits become doubles, doubles too big for
+    // that are an error.
+    std::string num(&buf_[pos_], len);
+    auto full = num.c_str() + len;
+    auto token = JsonToken::INT64;
+    char* stop = nullptr;
+    errno = 0;
+    intv_ = ::strtoll(num.c_str(), &stop, 10);
+    if ((stop != full) || (errno == ERANGE)) {
+      errno = 0;
+      dblv_ = ::strtod(num.c_str(), &stop);
+      token = JsonToken::DOUBLE;
+      if ((stop != full) ||
+          ((errno == ERANGE) && ((dblv_ > 1.0) || (dblv_ < -1.0)))) {
+        auto r = plx::RangeFromBytes(&buf_[pos_], len);
+        throw plx::CodecException(__LINE__, &r);
+      }
+    }
+    pos_ += len;
+    expect_ = after_value();
+    return token;
+  }
+};
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // plx::ParseJsonValue (converts a JSON string into a JsonValue)
 //
@@ -1874,6 +3635,14 @@ plx::JsonValue ParseJsonValue(plx::Range<const char>& range);
 plx::JsonValue ParseJsonValue(plx::Range<const char>& range) ;
 
 
+///////////////////////////////////////////////////////////////////////////////
+// plx::ParseJsonView (like ParseJsonValue but strings can point into |range|)
+// The strings without escapes are not copied, the text must outlive the
+// value. Arrays, objects and the other strings come from |arena| which
+// must outlive the value as well. JsonDocument takes care of both.
+plx::JsonValue ParseJsonView(plx::Range<const char>& range, plx::Arena* arena) ;
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // plx::ReuseObject
 //
@@ -2042,6 +3811,85 @@ public:
 plx::JsonValue JsonFromFile(plx::File& cfile) ;
 
 
+///////////////////////////////////////////////////////////////////////////////
+// plx::JsonDocument (a json file parsed in place)
+// mapped_ : the file text when it was big enough to map.
+// heap_ : the file text otherwise.
+// arena_ : the memory of every array, object and decoded string, freed in
+//   one go with the document.
+// root_ : the parsed value. Its strings without escapes point into the text
+//   and the rest lives in |arena_|, so the values are valid only as long
+//   as the document is. Copies of the values use the heap and can outlive
+//   it.
+//
+class JsonDocument {
+  plx::MappedFile mapped_;
+  std::unique_ptr<char[]> heap_;
+  std::unique_ptr<plx::Arena> arena_;
+  plx::JsonValue root_;
+
+  JsonDocument(const JsonDocument&) = delete;
+  JsonDocument& operator=(const JsonDocument&) = delete;
+
+public:
+  JsonDocument() {
+  }
+
+  // The text and the arena are moved by pointer so |root_| stays good.
+  JsonDocument(JsonDocument&& other)
+      : mapped_(std::move(other.mapped_)),
+        heap_(std::move(other.heap_)),
+        arena_(std::move(other.arena_)),
+        root_(std::move(other.root_)) {
+  }
+
+  static JsonDocument FromFile(plx::File& cfile) {
+    if (!cfile.is_valid())
+      throw plx::IOException(__LINE__, L"<json file>");
+    JsonDocument doc;
+    plx::Range<const char> json;
+    auto size = cfile.size_in_bytes();
+    if (size >= 64 * 1024) {
+      doc.mapped_ = plx::MappedFile::Create(cfile);
+      auto view = doc.mapped_.view();
+      json = plx::Range<const char>(reinterpret_cast<const char*>(view.start()),
+                                    reinterpret_cast<const char*>(view.end()));
+    } else {
+      plx::Range<char> r(0, plx::To<size_t>(size));
+      doc.heap_ = plx::HeapRange(r);
+      auto rb = r.bytes();
+      if (cfile.read(rb, 0) != size)
+        throw plx::IOException(__LINE__, L"<json file>");
+      json = plx::Range<const char>(r.start(), r.end());
+    }
+    doc.parse(json);
+    return doc;
+  }
+
+  static JsonDocument FromString(const std::string& text) {
+    JsonDocument doc;
+    plx::Range<char> r(0, text.size());
+    doc.heap_ = plx::HeapRange(r);
+    if (!text.empty())
+      memcpy(r.start(), text.data(), text.size());
+    plx::Range<const char> json(r.start(), r.end());
+    doc.parse(json);
+    return doc;
+  }
+
+  plx::JsonValue& root() {
+    return root_;
+  }
+
+private:
+  void parse(plx::Range<const char>& json) {
+    // The values take about as much memory as the text.
+    arena_.reset(new plx::Arena(json.size()));
+    root_ = plx::ParseJsonView(json, arena_.get());
+  }
+};
+
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // plx::StringPrintf  (c-style printf for std strings)
@@ -2056,24 +3904,265 @@ int vsnprintf(wchar_t* buffer, size_t size,
 
 template <typename CH>
 std::basic_string<CH> StringPrintf(const CH* fmt, ...) {
-  int fmt_size = 128;
-  std::unique_ptr<CH> mem;
-
+  // Most results fit on the stack, the heap is only for long ones. Each
+  // attempt needs its own copy of the arguments.
+  CH stack_buf[256];
   va_list args;
   va_start(args, fmt);
+  va_list attempt;
+  va_copy(attempt, args);
+  int sz = vsnprintf(stack_buf, _countof(stack_buf), fmt, attempt);
+  va_end(attempt);
+
+  std::basic_string<CH> result;
+  if (sz < 0) {
+    result = stack_buf;
+  } else if (sz < static_cast<int>(_countof(stack_buf))) {
+    result.assign(stack_buf, sz);
+  } else {
+    std::unique_ptr<CH[]> mem(new CH[sz + 1]);
+    va_copy(attempt, args);
+    sz = vsnprintf(mem.get(), sz + 1, fmt, attempt);
+    va_end(attempt);
+    result.assign(mem.get());
+  }
+  va_end(args);
+  return result;
+}
 
-  while (true) {
-    mem.reset(new CH[fmt_size]);
-    int sz = vsnprintf(mem.get(), fmt_size, fmt, args);
-    if (sz < fmt_size)
-      break;
-    fmt_size = sz + 1;
+
+///////////////////////////////////////////////////////////////////////////////
+// plx::FormatTo (printf style formatting checked at compile time)
+// Writes into a caller buffer and never allocates. The supported specs are
+// %d %i %u %x %X %c %s and %%, with an optional '0' flag and width. The
+// length modifiers (l, ll, h, z) are accepted and ignored, the argument
+// type decides. Use it through PLX_FORMAT_TO() so the format is checked
+// against the arguments at compile time.
+//
+
+template <typename T, typename Enable = void>
+struct FormatKind {
+  static const char value = '?';
+};
+
+template <typename T>
+struct FormatKind<T, typename std::enable_if<
+    std::is_integral<T>::value && !std::is_same<T, char>::value>::type> {
+  static const char value = 'd';
+};
+
+template <>
+struct FormatKind<char> {
+  static const char value = 'c';
+};
+
+template <>
+struct FormatKind<const char*> {
+  static const char value = 's';
+};
+
+template <>
+struct FormatKind<char*> {
+  static const char value = 's';
+};
+
+template <>
+struct FormatKind<std::string> {
+  static const char value = 's';
+};
+
+constexpr bool IsFormatFlag(char c) {
+  return ((c >= '0') && (c <= '9')) ||
+         (c == 'l') || (c == 'h') || (c == 'z') || (c == 'I');
+}
+
+constexpr const char* SkipFormatFlags(const char* f) {
+  return IsFormatFlag(*f) ? SkipFormatFlags(f + 1) : f;
+}
+
+// Points to the conversion letter of the next spec or to the terminator.
+constexpr const char* NextConversion(const char* f) {
+  return !*f ? f :
+         (*f != '%') ? NextConversion(f + 1) :
+         (f[1] == '%') ? NextConversion(f + 2) :
+         SkipFormatFlags(f + 1);
+}
+
+constexpr bool ConversionMatches(char conv, char kind) {
+  return (kind == 'd') ? ((conv == 'd') || (conv == 'i') || (conv == 'u') ||
+                          (conv == 'x') || (conv == 'X')) :
+         (kind == 's') ? (conv == 's') :
+         (kind == 'c') ? (conv == 'c') :
+         false;
+}
+
+template <typename... Args>
+struct FormatCheck;
+
+template <>
+struct FormatCheck<> {
+  static constexpr bool ok(const char* f) {
+    return !*NextConversion(f);
   }
+};
 
-  va_end(args);
-  return mem.get();
+template <typename T, typename... Args>
+struct FormatCheck<T, Args...> {
+  static constexpr bool ok(const char* f) {
+    return *NextConversion(f) &&
+           ConversionMatches(*NextConversion(f), FormatKind<T>::value) &&
+           FormatCheck<Args...>::ok(NextConversion(f) + 1);
+  }
+};
+
+// Only used in decltype() to name the decayed argument types.
+template <typename... Args>
+FormatCheck<typename std::decay<Args>::type...> FormatTypes(const Args&...);
+
+template <bool matches>
+struct FormatChecked {
+  static_assert(matches, "format string does not match the arguments");
+};
+
+class FormatSink {
+  char* buf_;
+  size_t size_;
+  size_t used_;
+
+public:
+  explicit FormatSink(plx::Range<char> out)
+      : buf_(out.start()), size_(out.size()), used_(0) {
+  }
+
+  void put(char c) {
+    if (used_ + 1 < size_)
+      buf_[used_++] = c;
+  }
+
+  void put(const char* str, size_t len) {
+    auto room = (used_ + 1 < size_) ? (size_ - used_ - 1) : 0;
+    len = (len < room) ? len : room;
+    memcpy(buf_ + used_, str, len);
+    used_ += len;
+  }
+
+  void pad(char c, size_t count) {
+    while (count--)
+      put(c);
+  }
+
+  size_t finish() {
+    if (size_)
+      buf_[used_] = 0;
+    return used_;
+  }
+};
+
+struct FormatSpec {
+  bool zero;
+  size_t width;
+  char conv;
+};
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value>::type
+FormatArg(FormatSink& sink, const FormatSpec& spec, T value) {
+  char digits[24];
+  size_t count = 0;
+  bool negative = std::is_signed<T>::value && (value < 0);
+  unsigned long long u = negative ?
+      (0ULL - static_cast<unsigned long long>(value)) :
+      static_cast<unsigned long long>(value);
+  if ((spec.conv == 'x') || (spec.conv == 'X')) {
+    const char* hex = (spec.conv == 'x') ? "0123456789abcdef" : "0123456789ABCDEF";
+    do { digits[count++] = hex[u & 0xf]; u >>= 4; } while (u);
+  } else {
+    do { digits[count++] = char('0' + (u % 10)); u /= 10; } while (u);
+  }
+  auto len = count + (negative ? 1 : 0);
+  if (negative && spec.zero)
+    sink.put('-');
+  if (spec.width > len)
+    sink.pad(spec.zero ? '0' : ' ', spec.width - len);
+  if (negative && !spec.zero)
+    sink.put('-');
+  while (count)
+    sink.put(digits[--count]);
+}
+
+inline void FormatArg(FormatSink& sink, const FormatSpec& spec, char value) {
+  sink.put(value);
+}
+
+inline void FormatArg(FormatSink& sink, const FormatSpec& spec, const char* value) {
+  auto len = strlen(value);
+  if (spec.width > len)
+    sink.pad(' ', spec.width - len);
+  sink.put(value, len);
 }
 
+inline void FormatArg(FormatSink& sink, const FormatSpec& spec, const std::string& value) {
+  if (spec.width > value.size())
+    sink.pad(' ', spec.width - value.size());
+  sink.put(value.c_str(), value.size());
+}
+
+// Copies literal text up to the next spec and parses it. Returns false at
+// the end of the format.
+inline bool NextFormatSpec(FormatSink& sink, const char*& fmt, FormatSpec* spec) {
+  while (*fmt) {
+    if (*fmt != '%') {
+      sink.put(*fmt++);
+      continue;
+    }
+    if (fmt[1] == '%') {
+      sink.put('%');
+      fmt += 2;
+      continue;
+    }
+    ++fmt;
+    spec->zero = (*fmt == '0');
+    spec->width = 0;
+    while ((*fmt >= '0') && (*fmt <= '9'))
+      spec->width = (spec->width * 10) + (*fmt++ - '0');
+    while (IsFormatFlag(*fmt))
+      ++fmt;
+    spec->conv = *fmt;
+    if (*fmt)
+      ++fmt;
+    return true;
+  }
+  return false;
+}
+
+inline void FormatImpl(FormatSink& sink, const char* fmt) {
+  FormatSpec spec;
+  while (NextFormatSpec(sink, fmt, &spec)) {
+  }
+}
+
+template <typename T, typename... Args>
+void FormatImpl(FormatSink& sink, const char* fmt, const T& first, const Args&... rest) {
+  FormatSpec spec;
+  if (!NextFormatSpec(sink, fmt, &spec))
+    return;
+  FormatArg(sink, spec, first);
+  FormatImpl(sink, fmt, rest...);
+}
+
+// Returns the number of chars written, the output is cut to fit and is
+// always zero terminated.
+template <typename... Args>
+size_t FormatTo(plx::Range<char> out, const char* fmt, const Args&... args) {
+  FormatSink sink(out);
+  FormatImpl(sink, fmt, args...);
+  return sink.finish();
+}
+
+#define PLX_FORMAT_TO(out, fmt, ...) \
+  (plx::FormatChecked<decltype(plx::FormatTypes(__VA_ARGS__))::ok(fmt)>(), \
+   plx::FormatTo(out, fmt, __VA_ARGS__))
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // plx::Process
@@ -2110,9 +4199,11 @@ public:
     return false;
   }
 
-  bool kill(unsigned int ret_code) {
+  bool kill(unsigned int ret_code, unsigned long wait_ms = 0) {
     if (!::TerminateProcess(handle_, ret_code))
       return false;
+    if (wait_ms)
+      ::WaitForSingleObject(handle_, wait_ms);
     Process closer(std::move(*this));
     return true;
   }